@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <packet.h>
+#include <pcap_reader.h>
+#include <io_backend.h>
+
+
+/**
+ * @brief Set of capture files read as a single capture
+ *
+ * For captures that have been rotated into several files. Packets from all
+ * of the files are merged into time order with a k-way heap merge, so each
+ * file must be in time order but the files may overlap. Nothing is copied
+ * or concatenated, packets point into the file that they were read from.
+ */
+class CaptureSet {
+  public:
+    // Position of the next packet to be read from the set
+    struct Cursor {
+      std::vector<PcapReader::Cursor> cursors;
+      // Packet read ahead from each file. heap holds the indexes of the
+      // files that have not been read to the end, earliest packet first.
+      std::vector<Packet> next;
+      std::vector<size_t> heap;
+      size_t index;
+    };
+
+    // Splits a comma separated list of files, and expands any glob patterns
+    // in it in sorted order. A path that names an existing file, or "-"
+    // for stdin, is used as it is.
+    static std::vector<std::string> ExpandPaths(const std::string& paths);
+
+    // All of the files must have the same link layer
+    CaptureSet(const std::vector<std::string>& paths,
+               const IoBackend::Options& io_options);
+    // Applied to each file (see PcapReader)
+    void SetTimeWindow(Timestamp start, Timestamp end);
+    void SetPrefetch(size_t distance);
+    Cursor Begin() const;
+    bool Next(Cursor& cursor, Packet& packet) const;
+    size_t NumFiles() const;
+    const PcapReader& GetReader(size_t index) const;
+    // Index of the file that packet data points into, and the offset of the
+    // data in that file
+    size_t FindFile(const uint8_t* data, size_t& offset) const;
+    uint32_t GetLinkLayer() const;
+    // True if any of the files has nanosecond timestamps
+    bool IsNanosecond() const;
+    // Names of all of the files, for messages
+    std::string GetFilename() const;
+  private:
+    std::vector<PcapReader> readers_;
+};
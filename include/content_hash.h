@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+namespace ContentHash {
+
+  // Returns a 64 bit fingerprint of data[0, length). Bytes before
+  // mask_length are ANDed with mask first, so bytes that a masked compare
+  // ignores never change the fingerprint. mask must be readable in whole 8
+  // byte words up to mask_length (see MaskedCompare::ByteMask).
+  using Function = uint64_t (*)(const uint8_t* data, size_t length,
+                                const uint8_t* mask, size_t mask_length);
+
+  // Select the fastest kernel supported by the CPU the program is running
+  // on. Kernels give different fingerprints for the same data.
+  Function Select();
+  const char* SelectedName();
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <memory>
+
+#include <mapped_file.h>
+#include <input_stream.h>
+
+/**
+ * @brief Reads inputs that can't be memory mapped directly
+ * 
+ * This covers gzip, zstd and lz4 captures, and pipes such as stdin.
+ * The input is decompressed or read straight into one block of anonymous
+ * memory, which is used in place of the mapped file, so packets can still
+ * point directly into it and no temporary file is written. With --stream,
+ * the input is instead decompressed or read on a separate thread while it
+ * is parsed (see InputStream).
+ */
+namespace Decompressor {
+
+  enum class Format {None, Gzip, Zstd, Lz4};
+
+  // Detected from the magic number at the start of the file
+  Format DetectFormat(const MappedFile& file);
+  Format DetectFormat(const uint8_t* data, size_t size);
+  const char* FormatName(Format format);
+
+  // Throws if the data is corrupt, or support for the format was not built
+  std::shared_ptr<const MappedFile> Decompress(const MappedFile& file,
+                                               Format format,
+                                               const std::string& path);
+
+  // Read a pipe, FIFO or other stream until end of file. The caller
+  // still owns fd.
+  std::shared_ptr<const MappedFile> ReadStream(int fd,
+                                               const std::string& path);
+  // Read a pipe, FIFO or other stream in the background while it is
+  // parsed. If owned, fd is closed once the stream is destroyed.
+  std::shared_ptr<InputStream> OpenStream(int fd, bool owned,
+                                          bool huge_pages);
+  // Decompress in the background while the output is parsed. Throws if
+  // support for the format was not built.
+  std::shared_ptr<InputStream> OpenStream(
+      std::shared_ptr<const MappedFile> file, Format format,
+      const std::string& path, bool huge_pages);
+  std::shared_ptr<InputStream> OpenStream(
+      std::shared_ptr<InputStream> input, Format format,
+      const std::string& path, bool huge_pages);
+
+}
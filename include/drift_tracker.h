@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <utility>
+
+#include <timestamp.h>
+
+
+/**
+ * @brief Online estimate of the clock offset and skew between two files
+ *
+ * Fed with the timestamps of matched packets in time order. The time
+ * difference (B - A) is modelled as offset + skew * time. Matches are
+ * summarised in blocks by their median, so the odd wrong match has no
+ * effect, and a line is fitted through the most recent blocks. The
+ * estimate follows skew that changes slowly over a long capture.
+ */
+class DriftTracker {
+  public:
+    DriftTracker();
+    void AddMatch(Timestamp time_a, Timestamp time_b);
+    // Expected time_b - time_a for a packet in A at time_a
+    Timestamp Predict(Timestamp time_a) const;
+    // Skew of B relative to A in parts per million
+    double GetSkewPpm() const;
+    size_t NumMatches() const;
+  private:
+    void Fit();
+    // Matches in the current block
+    std::vector<int64_t> block_times_;
+    std::vector<int64_t> block_deltas_;
+    // Median time and time difference of recent blocks
+    std::deque<std::pair<int64_t, int64_t>> points_;
+    size_t num_matches_;
+    // Fitted line: delta = intercept_ + slope_ * (time - reference_)
+    int64_t reference_;
+    double intercept_;
+    double slope_;
+};
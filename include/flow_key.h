@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+
+#include <packet.h>
+
+namespace FlowKey {
+
+  // Key of packets that aren't IPv4 or IPv6, or are cut short
+  constexpr uint64_t kNone = 0;
+
+  // Returns a hash of the IP version, protocol, addresses and ports of the
+  // packet, so packets of the same flow in the same direction get the same
+  // key. VLAN tags are skipped, and ports are only read from TCP, UDP,
+  // UDP-Lite and SCTP headers that are not in a later fragment. Ethernet,
+  // raw IP and Linux cooked (SLL and SLL2) link layers are understood.
+  uint64_t Get(const Packet& packet, uint32_t link_layer);
+
+}
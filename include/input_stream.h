@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <mapped_file.h>
+
+/**
+ * @brief Input that is read in the background and parsed as it arrives
+ *
+ * Used with --stream for inputs that can't be memory mapped. A producer
+ * thread reads the input into a ring of large blocks, staying a few blocks
+ * ahead of the parser, and packets are parsed and compared in place in the
+ * blocks. A block is reused once everything in it has been released, so
+ * memory use doesn't grow with the length of the input. A record that
+ * crosses the end of a block is copied once into a carry buffer, so it can
+ * still be read in one piece.
+ *
+ * Only one thread may read from the input.
+ */
+class InputStream {
+  public:
+    /**
+     * @brief Source of the input data, run on the producer thread
+     */
+    class Producer {
+      public:
+        virtual ~Producer() {}
+        // Fills out with up to capacity bytes, and returns the number
+        // written. Returns 0 at the end of the input.
+        virtual size_t Read(uint8_t* out, size_t capacity) = 0;
+        // Called from another thread to stop a Read that is waiting for
+        // more input
+        virtual void Cancel() {}
+    };
+
+    // Blocks are backed by huge pages where possible if huge_pages is set
+    InputStream(std::unique_ptr<Producer> producer, bool huge_pages);
+    ~InputStream();
+    InputStream(const InputStream&) = delete;
+    InputStream& operator=(const InputStream&) = delete;
+
+    // Waits until the input has been read up to end, or has ended. Returns
+    // the number of bytes read so far, which is less than end only at the
+    // end of the input. Rethrows any error from the producer.
+    size_t WaitFor(size_t end);
+    // [offset, offset + length) of the input in one piece. It must have
+    // been waited for, and not released.
+    const uint8_t* Get(size_t offset, size_t length);
+    // Sets data to the input from offset up to the end of its block, and
+    // returns the length, for reading the input a piece at a time. Returns
+    // 0 at the end of the input.
+    size_t GetPiece(size_t offset, const uint8_t*& data);
+    // Finds the offset in the input of data returned by Get. Returns false
+    // if the data is not from this input.
+    bool FindOffset(const uint8_t* data, size_t& offset);
+    // Nothing before end will be read again. Blocks that end before it are
+    // reused.
+    void Release(size_t end);
+    // Stops the producer. Any wait then returns as if the input had ended.
+    void Cancel();
+
+  private:
+    struct Block {
+      std::unique_ptr<MappedFile> memory;
+      // Offset in the input of the first byte, and bytes filled so far
+      size_t offset;
+      size_t length;
+    };
+    // Copy of a record that crosses the end of a block
+    struct Carry {
+      std::vector<uint8_t> data;
+      size_t offset;
+    };
+
+    void Produce();
+    bool AcquireBlock(uint8_t*& data);
+    // Requires the lock. Block holding offset, which must not be released.
+    const Block& FindBlock(size_t offset) const;
+
+    std::unique_ptr<Producer> producer_;
+    bool huge_pages_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    // Blocks that have not been released, in input order. The last one is
+    // being filled.
+    std::deque<Block> blocks_;
+    std::vector<std::unique_ptr<MappedFile>> free_;
+    std::deque<Carry> carries_;
+    // Bytes read by the producer, and the furthest the parser has waited
+    // for
+    size_t filled_;
+    size_t requested_;
+    bool finished_;
+    bool cancelled_;
+    std::exception_ptr error_;
+    // Parser side copy of the part of a block last read from, which can be
+    // read without taking the lock. Filled data never changes, and a block
+    // is only reused once the parser has released it.
+    size_t view_offset_;
+    size_t view_length_;
+    const uint8_t* view_data_;
+    // Data known to have been read, also without the lock
+    size_t view_filled_;
+    std::thread thread_;
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+#include <memory>
+
+#include <mapped_file.h>
+#include <input_stream.h>
+
+/**
+ * @brief Ways of reading a regular input file into memory
+ * 
+ * mmap maps the file and relies on page faults to read it. pread and
+ * uring read the whole file into anonymous memory with large explicit
+ * reads, which keeps NVMe queues busy when the file is not in the page
+ * cache. uring keeps many reads in flight through io_uring. With direct
+ * I/O the reads bypass the page cache, so a one-off huge diff does not
+ * evict it. With --stream, pread and uring instead read into the reused
+ * blocks of an InputStream, a little ahead of the parser.
+ */
+namespace IoBackend {
+
+  enum class Type {Mmap, Pread, Uring};
+
+  // Throws for an unknown backend name
+  Type Parse(const std::string& name);
+
+  struct Options {
+    Type type;
+    bool direct;
+    // mmap only: read the whole file in when it is mapped
+    bool populate;
+    // Back the file data with transparent huge pages where possible
+    bool huge_pages;
+    // The input is only read once from start to end (--stream), so pipes
+    // are parsed as they are read rather than being read into memory
+    bool streamed;
+  };
+
+  std::shared_ptr<const MappedFile> Read(const std::string& path,
+                                         const Options& options);
+  // Reads the file in the background while it is parsed, for the pread
+  // and uring backends
+  std::shared_ptr<InputStream> Stream(const std::string& path,
+                                      const Options& options);
+
+}
@@ -8,7 +8,16 @@
  */
 class MappedFile {
   public:
-    MappedFile(const std::string& path, bool writable = false, size_t size = 0);
+    // Expected access pattern, passed on to the kernel
+    enum class Access {Normal, Sequential, Random};
+
+    // populate reads the whole file into memory when it is mapped
+    MappedFile(const std::string& path, bool writable = false, size_t size = 0,
+               bool populate = false);
+    // Writable memory that is not backed by a file, for holding data that
+    // has to be produced in memory (e.g. decompressed input). It can be
+    // grown with Resize, which may move the data.
+    static MappedFile Anonymous(size_t size);
     // Class manages a resource that needs a custom destructor
     ~MappedFile();
     // Custom destructor therefore "rule of 5" applies
@@ -24,7 +33,23 @@ class MappedFile {
     const uint8_t* Data() const;
     uint8_t* DataWritable();
     size_t Size() const;
+    void Resize(size_t size);
+    // Hints about how the memory will be used. They only change
+    // performance, so errors are ignored.
+    void Advise(Access access) const;
+    // Back the memory with transparent huge pages where the kernel allows.
+    // Works for anonymous memory, and files on filesystems that support it.
+    void AdviseHugePages() const;
+    // Start reading [offset, offset + length) in the background
+    void Prefetch(size_t offset, size_t length) const;
+    // [offset, offset + length) will not be read again. Whole pages in the
+    // range are dropped, and file pages are also dropped from the page
+    // cache. Anonymous memory reads back as zeros after being released.
+    // Returns the offset that the next consecutive release should start
+    // from, which is the end of the released pages.
+    size_t Release(size_t offset, size_t length) const;
   private:
+    MappedFile() : writable_(true) {}
     void Cleanup();
     int fd_ = -1;
     uint8_t* data_ = nullptr;
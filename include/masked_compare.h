@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace MaskedCompare {
+
+  /**
+   * @brief Byte mask for the vectorised compare kernels
+   * 
+   * Each mask bit is expanded to a byte (0xFF: compare, 0x00: ignore).
+   * The storage is aligned and padded to a whole number of 64 byte vectors.
+   * Trailing compared bytes are dropped, as bytes after the end of the mask
+   * are always compared.
+   */
+  class ByteMask {
+    public:
+      static constexpr size_t kAlignment = 64;
+
+      explicit ByteMask(const std::vector<bool>& mask);
+      ~ByteMask();
+      // Owns aligned memory, so copying is disabled (as with MappedFile)
+      ByteMask(const ByteMask&) = delete;
+      ByteMask& operator=(const ByteMask&) = delete;
+      ByteMask(ByteMask&& other) noexcept;
+      ByteMask& operator=(ByteMask&& other) noexcept;
+
+      const uint8_t* Data() const;
+      size_t Size() const;
+    private:
+      uint8_t* data_ = nullptr;
+      size_t size_ = 0;
+  };
+
+  // Returns true if ((a[i] ^ b[i]) & mask[i]) == 0 for all i < length
+  using Function = bool (*)(const uint8_t* a, const uint8_t* b,
+                            const uint8_t* mask, size_t length);
+
+  // Select the widest kernel supported by the CPU the program is running on
+  Function Select();
+  const char* SelectedName();
+
+}
@@ -1,12 +1,19 @@
 #pragma once
 #include <cstdint>
 #include <vector>
-#include <pcap_file.h>
+#include <timestamp.h>
 
 
+/**
+ * @brief View of a single packet
+ * 
+ * The timestamp is decoded from the PCAP header so it can be offset, but
+ * the packet data is not copied. It points directly into the memory mapped
+ * input file, so the file must outlive the packet (see Packets).
+ */
 struct Packet {
-    struct PcapFile::PacketHeader header;
-    std::vector<uint8_t> data;
-    bool match;
-    const Packet* match_packet;
-};
\ No newline at end of file
+    Timestamp time;
+    uint32_t length;
+    const uint8_t* data;
+    size_t Size() const { return length; }
+};
@@ -4,32 +4,102 @@
 
 
 #include <packets.h>
+#include <masked_compare.h>
+#include <content_hash.h>
+#include <thread_pool.h>
+#include <drift_tracker.h>
 
 class PacketDiff {
   public:
+    // Result of EstimateTimeOffset
+    struct TimeAlignment {
+      // Nanoseconds to add to the timestamps in B to line them up with A
+      int64_t offset_ns;
+      // Sampled pairs of identical packets, and how many of them agree
+      // with the offset to within the matching time window
+      size_t num_pairs;
+      size_t num_agreeing;
+    };
 
     PacketDiff(const std::string& search_mode,
                const std::string& mask,
                const std::string& range_a,
                const std::string& range_b,
-               const std::pair<Timestamp, Timestamp>& time_range);
+               const std::pair<Timestamp, Timestamp>& time_range,
+               size_t num_threads = 0);
     void FindMatching(Packets& packets_a, Packets& packets_b);
+    // Finds the time offset between the files from the timestamps of
+    // identical packets. Only a sample of the packets is used, chosen by
+    // hash so that identical packets are sampled in both files.
+    TimeAlignment EstimateTimeOffset(Packets& packets_a, Packets& packets_b);
+    bool ComparePacket(const Packet& packet_a, const Packet& packet_b) const;
+    // Fingerprints of the compared bytes. Packets that compare equal always
+    // have the same fingerprint, so different fingerprints rule out a match.
+    uint64_t HashPacketA(const Packet& packet) const;
+    uint64_t HashPacketB(const Packet& packet) const;
+    const std::pair<Timestamp, Timestamp>& GetTimeRange() const;
+    // Re-centre the timestamp search window on the clock drift estimated
+    // from the matches found so far. The search then runs on one thread,
+    // as each window depends on the matches before it.
+    void SetTrackDrift(bool track_drift);
+    bool IsTrackingDrift() const;
+    const DriftTracker& GetDriftTracker() const;
+    // Only match packets in the same flow (see FlowKey). Each flow is then
+    // searched on its own, and the flows are spread across the threads.
+    // Not supported by the location search method or with drift tracking.
+    void SetMatchByFlow(bool match_by_flow);
+    // Identifies the mask, byte range and hash kernel that packet hashes
+    // depend on, so that stored hashes are only reused with the same
+    // settings
+    static uint64_t GetSettingsKey(const std::string& mask,
+                                   const std::string& range);
  
   private:
-    enum class SearchMethod {Timestamp, Full, Location};
+    enum class SearchMethod {Timestamp, Full, Location, Sequence};
     static std::vector<bool> MaskStringToVector(const std::string& mask_str);
     static std::pair<size_t, int> RangeStringToPair(
           const std::string& range_str);
+    static bool SelectRange(const Packet& packet,
+                            const std::pair<size_t, int>& range,
+                            size_t& start, size_t& end);
+    uint64_t HashPacket(const Packet& packet,
+                        const std::pair<size_t, int>& range) const;
+    void HashPackets(Packets& packets, const std::pair<size_t, int>& range);
+    // ComparePacket that rejects on the packet hashes first, which must
+    // have been set with HashPackets
+    bool ComparePacket(const Packets& packets_a, size_t index_a,
+                       const Packets& packets_b, size_t index_b) const;
+    // True if the timestamp search should look up packets by hash rather
+    // than scan each window
+    bool UseWindowIndex(const Packets& packets_b) const;
+    // (hash, time) of every packet whose hash is a multiple of rate after
+    // mixing, sorted
+    std::vector<std::pair<uint64_t, int64_t>> SampleHashes(
+        const Packets& packets, const std::pair<size_t, int>& range,
+        uint64_t rate);
 
     SearchMethod search_method_;
-    std::vector<bool> mask_;
+    MaskedCompare::ByteMask mask_;
+    MaskedCompare::Function masked_compare_;
+    ContentHash::Function content_hash_;
     std::pair<size_t,int> range_a_;
     std::pair<size_t,int> range_b_;
     std::pair<Timestamp, Timestamp> time_range_;
+    ThreadPool thread_pool_;
+    bool track_drift_;
+    DriftTracker drift_tracker_;
+    bool match_by_flow_;
     SearchMethod ParseSearchMethod(const std::string& search_method);
     void FindMatchingTimestampSearch(Packets& packets_a, Packets& packets_b);
+    void FindMatchingTimestampSearchParallel(Packets& packets_a,
+                                             Packets& packets_b);
     void FindMatchingFullSearch(Packets& packets_a, Packets& packets_b);
     void FindMatchingLocationSearch(Packets& packets_a, Packets& packets_b);
-    bool ComparePacket(const Packet& packet_a, const Packet& packet_b) const;
+    void FindMatchingSequenceSearch(Packets& packets_a, Packets& packets_b);
+    void FindMatchingByFlow(Packets& packets_a, Packets& packets_b);
+    // Flow key of every packet (see FlowKey)
+    std::vector<uint64_t> GetFlowKeys(const Packets& packets);
+    static void SetMatch(Packets& packets_a, size_t index_a,
+                         Packets& packets_b, size_t index_b);
 
   };
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief Layout of the .pdidx sidecar file that caches a loaded PCAP
+ * 
+ * The header is followed by the packet columns, each num_packets long:
+ * timestamps (int64 ns), data offsets (uint64), content hashes (uint64,
+ * only if kFlagHashes is set) and lengths (uint32). The index is only
+ * used if the size and modification time of the PCAP still match, and
+ * the hashes only if they were made with the same byte range and mask.
+ */
+namespace PacketIndex {
+
+  constexpr uint32_t kMagic = 0x58444950; // "PIDX"
+  // Increase whenever the layout or the packet hash function changes
+  constexpr uint32_t kVersion = 2;
+
+  constexpr uint32_t kFlagNanosecond = 1 << 0;
+  constexpr uint32_t kFlagHashes = 1 << 1;
+
+  struct FileHeader {
+    uint32_t magic_number;
+    uint32_t version;
+    uint64_t pcap_size;
+    int64_t pcap_mtime_ns;
+    uint64_t settings_key;
+    uint64_t num_packets;
+    uint32_t link_type;
+    uint32_t flags;
+  };
+
+  // Size and modification time of the file the index was built from
+  struct SourceKey {
+    uint64_t size;
+    int64_t mtime_ns;
+  };
+
+  std::string GetPath(const std::string& pcap_path);
+  // Returns false if the file is not a regular file (e.g. a pipe), as
+  // only regular files are indexed
+  bool GetSourceKey(const std::string& pcap_path, SourceKey& key);
+  size_t GetFileSize(uint64_t num_packets, bool hashes);
+
+}
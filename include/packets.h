@@ -2,25 +2,112 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <memory>
 #include <packet.h>
+#include <mapped_file.h>
+#include <pcap_reader.h>
+#include <capture_set.h>
 
 
+/**
+ * @brief Columnar store of the packets loaded from a PCAP file
+ * 
+ * Each packet field is held in its own contiguous array, so the matching
+ * algorithms can scan timestamps without touching the rest of the packet.
+ * Packet data is not copied, only its offset into the mapped file is kept.
+ * Piped and decompressed input is read into one block of anonymous memory
+ * per file (see Decompressor), which is freed in one go with the file.
+ * Packets may come from several files (see CaptureSet).
+ */
 class Packets {
   public:
+    // Index stored for packets that have no match
+    static constexpr uint32_t kNoMatch = UINT32_MAX;
+
     Packets();
-    void Load(std::vector<Packet>, uint32_t link_layer);
+    // Files that can be indexed are decoded on num_threads threads
+    // (0: hardware concurrency)
+    void Load(const PcapReader& reader, uint64_t max_packets = 0,
+              size_t num_threads = 0);
+    // Sets of more than one file are merged into time order on one thread
+    void Load(const CaptureSet& captures, uint64_t max_packets = 0,
+              size_t num_threads = 0);
+    // Load from a sidecar index written by SaveIndex (see PacketIndex).
+    // Returns false if there is no index or it is out of date. Hashes are
+    // only kept if settings_key matches the one they were saved with.
+    // Inputs that are not regular files (e.g. pipes) are never indexed.
+    bool LoadIndex(const PcapReader& reader, const std::string& index_path,
+                   uint64_t settings_key, uint64_t max_packets = 0);
+    void SaveIndex(const std::string& pcap_path,
+                   const std::string& index_path,
+                   uint64_t settings_key) const;
     size_t Size() const;
-    Packet& operator[](size_t index);
-    const Packet& operator[](size_t index) const;
+    Packet operator[](size_t index) const;
+    const std::vector<Timestamp>& GetTimes() const;
+    bool IsMatched(size_t index) const;
+    uint32_t GetMatch(size_t index) const;
+    void SetMatch(size_t index, uint32_t match_index);
+    size_t NumMatched() const;
     std::string GetMetadataString() const;
     std::string GetStartTimeString() const;
     uint32_t GetLinkLayer() const;
+    bool IsNanosecond() const;
     void OffsetTimestamps(double time_offset);
-    std::vector<Packet>::iterator begin();    
-    std::vector<Packet>::iterator end();
-    const std::vector<Packet>::const_iterator begin() const;    
-    const std::vector<Packet>::const_iterator end() const;
+    // Content hash of each packet, as used by the full search method
+    bool HasHashes() const;
+    uint64_t GetHash(size_t index) const;
+    void SetHashes(std::vector<uint64_t>&& hashes);
+    // The packets at the given indexes, in that order, so that part of a
+    // capture can be searched on its own. Packet data and hashes are taken
+    // from this store. The subset starts out with no matches.
+    Packets Subset(const uint32_t* indexes, size_t count) const;
   private:
-    std::vector<Packet> packets_;
+    void CheckLoaded(const std::string& filename);
+    void SetSource(std::shared_ptr<const MappedFile> source);
+    void LoadIndexed(const PcapReader& reader, uint64_t max_packets,
+                     size_t num_threads);
+    std::vector<Timestamp> times_;
+    std::vector<uint32_t> lengths_;
+    std::vector<uint64_t> offsets_;
+    std::vector<uint64_t> matched_;
+    std::vector<uint32_t> match_index_;
+    std::vector<uint64_t> hashes_;
+    // Total offset applied by OffsetTimestamps, removed again by SaveIndex
+    int64_t time_offset_ns_;
     uint32_t link_layer_;
-};
\ No newline at end of file
+    bool nanosecond_;
+    // Keeps the files that the packet data points into mapped
+    std::vector<std::shared_ptr<const MappedFile>> sources_;
+    // Offsets are from the start of the first file. Offsets of packets in
+    // the other files wrap around, which unsigned arithmetic allows for.
+    uintptr_t base_;
+};
+
+inline Packet Packets::operator[](size_t index) const {
+  return Packet{times_[index], lengths_[index],
+                reinterpret_cast<const uint8_t*>(base_ + offsets_[index])};
+}
+
+inline const std::vector<Timestamp>& Packets::GetTimes() const {
+  return times_;
+}
+
+inline bool Packets::IsMatched(size_t index) const {
+  return (matched_[index / 64] >> (index % 64)) & 1;
+}
+
+inline uint32_t Packets::GetMatch(size_t index) const {
+  return match_index_[index];
+}
+
+inline bool Packets::HasHashes() const {
+  return !hashes_.empty();
+}
+
+inline uint64_t Packets::GetHash(size_t index) const {
+  return hashes_[index];
+}
+
+inline size_t Packets::Size() const {
+  return times_.size();
+}
@@ -2,10 +2,15 @@
 #include <cstdint>
 #include <cstddef>
 
-#include <timestamp.h>
-
 namespace PcapFile {
 
+  // Magic numbers for the supported timestamp resolutions
+  constexpr uint32_t kMagicMicroseconds = 0xA1B2C3D4;
+  constexpr uint32_t kMagicNanoseconds = 0xA1B23C4D;
+  // As read from a file written on a machine of the opposite endian
+  constexpr uint32_t kMagicMicrosecondsSwapped = 0xD4C3B2A1;
+  constexpr uint32_t kMagicNanosecondsSwapped = 0x4D3CB2A1;
+
   struct FileHeader {
     uint32_t magic_number;
     uint16_t major_version;
@@ -17,12 +22,26 @@ namespace PcapFile {
   };
   
   struct PacketHeader {
-    struct Timestamp time;
+    uint32_t ts_sec;
+    // Microseconds, or nanoseconds in a nanosecond resolution file
+    uint32_t ts_frac;
     uint32_t incl_len;
     uint32_t orig_len;
   };
   
-  struct FileHeader GetStandardHeader(uint32_t link_layer);
+  struct FileHeader GetStandardHeader(uint32_t link_layer,
+                                      bool nanosecond = false);
+
+  // Reverse the byte order of every header field
+  void SwapFileHeader(FileHeader& header);
+
+  // Copies a packet header out of the file, converting it to the
+  // processor's byte order
+  using ReadFunction = void (*)(const uint8_t* data, PacketHeader& header);
+
+  // Select the packet header reader for a file of the given byte order.
+  // Swapped headers use a single vector shuffle when the CPU supports it.
+  ReadFunction SelectReader(bool swapped);
 
 }
 
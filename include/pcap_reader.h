@@ -1,23 +1,108 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
 
 #include <packet.h>
 #include <mapped_file.h>
 #include <pcap_file.h>
+#include <pcapng_file.h>
+#include <io_backend.h>
+#include <input_stream.h>
 
 
 /**
- * @brief Class for reading PCAP files
+ * @brief Class for reading PCAP and pcapng files
  * 
+ * The file format is detected from the first block. Packets are read
+ * directly from the memory mapped file in both cases, or from the blocks of
+ * a streamed input (see InputStream).
  */
 class PcapReader {
   public:
-    PcapReader(const std::string& path);
-    std::vector<Packet> GetPackets(uint64_t max_packets = 0) const;
+    // Position of the next packet to be read from the file
+    struct Cursor {
+      size_t offset;
+      size_t index;
+      // pcapng only: interfaces of the current section, and the timestamp
+      // of the last packet (Simple Packet Blocks have no timestamp)
+      std::vector<PcapngFile::Interface> interfaces;
+      Timestamp last_time;
+      // End of the data that has been prefetched
+      size_t prefetched;
+    };
+
+    // io_options selects how regular files are read into memory
+    PcapReader(const std::string& path,
+               const IoBackend::Options& io_options =
+                   IoBackend::Options{IoBackend::Type::Mmap, false, false,
+                                      false, false});
+    // Only read packets with timestamps in [start, end]. Packets must be in
+    // time order. Begin() then seeks to the first packet at or after start,
+    // by bisection for classic PCAP files, and Next stops after end.
+    void SetTimeWindow(Timestamp start, Timestamp end);
+    // Keep the file read in the background up to distance bytes ahead of
+    // the packet being read. 0 leaves it to the kernel's own readahead.
+    void SetPrefetch(size_t distance);
+    // Read packets one at a time. Next returns false once there are no
+    // more packets.
+    Cursor Begin() const;
+    bool Next(Cursor& cursor, Packet& packet) const;
+    // Two phase reading, for loading a whole file on several threads.
+    // IndexPackets records the offset of each packet header with a light
+    // serial scan, then ReadIndexed decodes any indexed packet. Only
+    // classic PCAP files can be indexed, as pcapng packets depend on the
+    // interfaces defined before them.
+    bool CanIndex() const;
+    void IndexPackets(std::vector<uint64_t>& offsets,
+                      uint64_t max_packets = 0) const;
+    Packet ReadIndexed(uint64_t offset, size_t index) const;
     uint32_t GetLinkLayer() const;
+    // True if timestamps have nanosecond rather than microsecond resolution
+    bool IsNanosecond() const;
+    // True if the input is parsed as it is read, and is never in memory as
+    // a whole. Packets can then only be read once, with a single cursor.
+    bool IsStreamed() const;
+    // Null if the input is streamed
+    std::shared_ptr<const MappedFile> GetFile() const;
+    // Finds the offset in the file of packet data read from it. Returns
+    // false if the data is not from this file.
+    bool FindOffset(const uint8_t* data, size_t& offset) const;
+    // [offset, offset + length) of the file will not be read again (see
+    // MappedFile::Release). Returns the offset that the next consecutive
+    // release should start from.
+    size_t Release(size_t offset, size_t length) const;
+    const std::string& GetFilename() const;
   private:
-    MappedFile pcap_file_;
+    // Bytes of the file available up to end, which is less than end only at
+    // the end of the file, and [offset, offset + length) of it in one piece
+    size_t Available(size_t end) const;
+    const uint8_t* GetData(size_t offset, size_t length) const;
+    void ParsePcapHeader();
+    void ParsePcapngHeader();
+    bool NextPcap(Cursor& cursor, Packet& packet) const;
+    uint64_t SeekPcap(Timestamp time) const;
+    uint64_t ResyncPcap(uint64_t offset, uint64_t limit, Timestamp min_time,
+                        Timestamp max_time) const;
+    bool IsPlausiblePcap(uint64_t offset, uint64_t limit, Timestamp min_time,
+                         Timestamp max_time) const;
+    Packet DecodePacket(const PcapFile::PacketHeader& header,
+                        const uint8_t* data, size_t index) const;
+    bool NextPcapng(Cursor& cursor, Packet& packet) const;
+    void Prefetch(uint64_t offset, uint64_t& prefetched) const;
+    const uint8_t* NextBlock(size_t& offset,
+                             PcapngFile::BlockHeader& block) const;
+    void ParseSectionHeader(const uint8_t* body, size_t body_length) const;
+    std::shared_ptr<const MappedFile> pcap_file_;
+    std::shared_ptr<InputStream> stream_;
     PcapFile::FileHeader Header_;
+    PcapFile::ReadFunction read_header_;
     std::string filename_;
-};
\ No newline at end of file
+    bool pcapng_;
+    uint32_t link_layer_;
+    bool nanosecond_;
+    bool windowed_;
+    Timestamp window_start_;
+    Timestamp window_end_;
+    size_t prefetch_;
+};
@@ -2,8 +2,10 @@
 
 #include <string>
 #include <vector>
+#include <fstream>
 
 #include <packets.h>
+#include <pcap_file.h>
 
 namespace PcapWriter {
 
@@ -25,12 +27,49 @@ namespace PcapWriter {
 
   Mode StringToMode(const std::string& mode);
 
-  void CopyHeaderIncLen(uint8_t* file, PcapFile::PacketHeader header, 
+  /**
+   * @brief Incrementally writes a diff PCAP file
+   * 
+   * Used when the total size of the output is not known in advance. Packets
+   * must be passed in the order they should appear in the output. Packets
+   * that are not part of the selected output mode are ignored.
+   */
+  class StreamWriter {
+    public:
+      StreamWriter(const std::string& filename, const std::string& mode,
+                   uint32_t link_layer_a, uint32_t link_layer_b,
+                   bool nanosecond_a, bool nanosecond_b);
+      // match_packet is null if the packet from A was not matched
+      void WriteA(const Packet& packet, const Packet* match_packet);
+      void WriteB(const Packet& packet, bool matched);
+      void Close();
+    private:
+      uint8_t* Reserve(size_t num_bytes);
+      void Flush();
+      Mode mode_;
+      uint32_t link_layer_a_;
+      uint32_t link_layer_b_;
+      bool nanosecond_;
+      std::string filename_;
+      std::ofstream file_;
+      std::vector<uint8_t> buffer_;
+      size_t buffer_used_;
+  };
+
+  // nanosecond selects the resolution of the timestamp written to the file
+  void CopyHeaderIncLen(uint8_t* file, const Packet& packet, bool nanosecond,
                         uint32_t inc = 1);
   
+  uint8_t* WritePacket(uint8_t* file_ptr, const Packet& packet,
+                       bool nanosecond);
+  uint8_t* WritePacketBasicFormat(uint8_t* file_ptr, const Packet& packet,
+                                  bool nanosecond, uint8_t diff_byte);
   uint8_t* WritePacketFullFormat(uint8_t* file_ptr, const Packet& packet,
-                                 uint32_t link_layer, bool added);
+                                 bool nanosecond, uint32_t link_layer,
+                                 bool added);
   uint8_t* WritePacketFullFormatMatch(uint8_t* file_ptr, const Packet& packet,
+                                      const Packet& match_packet,
+                                      bool nanosecond,
                                       uint32_t link_layer_a,
                                       uint32_t link_layer_b);
 } 
\ No newline at end of file
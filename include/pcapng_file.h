@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+#include <timestamp.h>
+
+namespace PcapngFile {
+
+  // Block types
+  constexpr uint32_t kSectionHeaderBlock = 0x0A0D0D0A;
+  constexpr uint32_t kInterfaceDescriptionBlock = 0x00000001;
+  constexpr uint32_t kPacketBlock = 0x00000002; // Obsolete
+  constexpr uint32_t kSimplePacketBlock = 0x00000003;
+  constexpr uint32_t kEnhancedPacketBlock = 0x00000006;
+
+  constexpr uint32_t kByteOrderMagic = 0x1A2B3C4D;
+
+  // Every block starts with this header, followed by the block body and
+  // then a copy of block_total_length.
+  struct BlockHeader {
+    uint32_t block_type;
+    uint32_t block_total_length;
+  };
+
+  struct SectionHeader {
+    uint32_t byte_order_magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+  };
+
+  struct InterfaceDescription {
+    uint16_t link_type;
+    uint16_t reserved;
+    uint32_t snap_length;
+  };
+
+  struct EnhancedPacket {
+    uint32_t interface_id;
+    uint32_t timestamp_high;
+    uint32_t timestamp_low;
+    uint32_t captured_length;
+    uint32_t original_length;
+  };
+
+  struct ObsoletePacket {
+    uint16_t interface_id;
+    uint16_t drops_count;
+    uint32_t timestamp_high;
+    uint32_t timestamp_low;
+    uint32_t captured_length;
+    uint32_t original_length;
+  };
+
+  struct SimplePacket {
+    uint32_t original_length;
+  };
+
+  /**
+   * @brief Link type and timestamp format of a capture interface
+   * 
+   * Each Interface Description Block sets the timestamp resolution
+   * (if_tsresol) and offset (if_tsoffset) of the packets captured on it.
+   */
+  struct Interface {
+    uint32_t link_type;
+    uint32_t snap_length;
+    // Decimal resolutions are converted with a multiply or divide, binary
+    // resolutions with a shift (binary_shift is -1 for decimal).
+    int binary_shift;
+    uint64_t multiplier;
+    uint64_t divisor;
+    int64_t offset_ns;
+    bool nanosecond;
+    Timestamp GetTimestamp(uint32_t timestamp_high,
+                           uint32_t timestamp_low) const;
+  };
+
+  // Returns false if the block body or its options are malformed
+  bool ParseInterface(const uint8_t* body, size_t body_length,
+                      Interface& interface);
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <packet.h>
+#include <packet_diff.h>
+#include <capture_set.h>
+#include <drift_tracker.h>
+#include <pcap_writer.h>
+
+/**
+ * @brief Timestamp search that streams both PCAP files
+ *
+ * Produces the same matches as the 'timestamp' search method, but only keeps
+ * the packets that are inside the [-d, +D] time window in memory. Packets
+ * are passed to the writer as soon as their match can no longer change.
+ * Like the 'timestamp' search method, both files must be in time order.
+ */
+class StreamDiff {
+  public:
+    StreamDiff(const PacketDiff& packet_diff,
+               const CaptureSet& reader_a,
+               const CaptureSet& reader_b,
+               uint64_t max_packets,
+               double time_offset_a,
+               double time_offset_b);
+    // Drop the parts of both files that have been read and are no longer
+    // held, so that memory use stays flat for very large files. Streamed
+    // pipes are always dropped like this.
+    void SetDropBehind(bool drop_behind);
+    // writer may be null if no output file is required
+    void Run(PcapWriter::StreamWriter* writer);
+    size_t NumMatched() const;
+    size_t NumRemoved() const;
+    size_t NumAdded() const;
+    // Only updated if packet_diff is tracking clock drift
+    const DriftTracker& GetDriftTracker() const;
+
+  private:
+    // Packet from file A, with its own copy of the matching packet from
+    // file B. Packets from B may be written (and freed) before their match.
+    // Packets are hashed once when read (see PacketDiff::HashPacketA).
+    struct PacketA {
+      Packet packet;
+      uint64_t hash;
+      bool matched;
+      Packet match_packet;
+    };
+
+    struct PacketB {
+      Packet packet;
+      uint64_t hash;
+      bool matched;
+    };
+
+    // Same as Packets::OffsetTimestamps, but for one packet at a time
+    struct TimeOffset {
+      TimeOffset(double time_offset);
+      void Apply(Packet& packet) const;
+      Timestamp offset;
+    };
+
+    bool ReadA(Packet& packet);
+    bool ReadB();
+    void WriteA();
+    void WriteB();
+    void WritePackets(bool finished);
+    void ReleaseConsumed();
+    void Release(const CaptureSet& reader, const CaptureSet::Cursor& cursor,
+                 const std::vector<const Packet*>& held,
+                 std::vector<size_t>& released) const;
+
+    const PacketDiff& packet_diff_;
+    const CaptureSet& reader_a_;
+    const CaptureSet& reader_b_;
+    uint64_t max_packets_;
+    TimeOffset time_offset_a_;
+    TimeOffset time_offset_b_;
+
+    CaptureSet::Cursor cursor_a_;
+    CaptureSet::Cursor cursor_b_;
+    bool done_b_;
+    // Packets from A that have been searched but not written
+    std::deque<PacketA> packets_a_;
+    // Packets from B that have been read but not written
+    std::deque<PacketB> packets_b_;
+    // Index in packets_b_ of the first packet inside the current time window
+    size_t window_start_b_;
+    bool drop_behind_;
+    // Start of the data in each file that has not been released
+    std::vector<size_t> released_a_;
+    std::vector<size_t> released_b_;
+    // Number of packets read from both files at which to next look for
+    // data to release
+    size_t next_release_;
+
+    DriftTracker drift_tracker_;
+    PcapWriter::StreamWriter* writer_;
+    size_t num_matched_;
+    size_t num_removed_;
+    size_t num_added_;
+};
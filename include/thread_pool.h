@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <exception>
+
+/**
+ * @brief Fixed size pool of worker threads
+ * 
+ */
+class ThreadPool {
+  public:
+    // A num_threads of 0 uses the number of hardware threads
+    explicit ThreadPool(size_t num_threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t Size() const;
+    // Split [0, count) into chunks of at least min_chunk items and call
+    // function(begin, end) for each chunk across the pool. Blocks until all
+    // chunks are done. The first exception thrown by a chunk is rethrown.
+    void ParallelFor(size_t count, size_t min_chunk,
+                     const std::function<void(size_t, size_t)>& function);
+    // Call function(index) for each index in [0, count) across the pool,
+    // handing out one index at a time. For items of very uneven cost, which
+    // should be ordered with the most costly first.
+    void ParallelForEach(size_t count,
+                         const std::function<void(size_t)>& function);
+
+  private:
+    // Runs function(index) for each index in [0, num_chunks) across the
+    // pool, each thread taking the next index when it is free
+    void RunChunks(size_t num_chunks,
+                   const std::function<void(size_t)>& function);
+    void WorkerLoop();
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable task_ready_;
+    bool stopping_;
+};
@@ -2,20 +2,55 @@
 #include <cstdint>
 #include <string>
 
+/**
+ * @brief Packet timestamp stored as a signed count of nanoseconds
+ * 
+ * A single integer keeps comparisons and time window arithmetic to one
+ * instruction, and lets loops over arrays of timestamps be vectorised.
+ */
 struct Timestamp {
-  Timestamp(uint32_t ts_sec, uint32_t ts_usec);
+  Timestamp();
+  // Build from a PCAP packet header. ts_frac is in microseconds, or in
+  // nanoseconds if the file uses nanosecond resolution.
+  Timestamp(uint32_t ts_sec, uint32_t ts_frac, bool nanosecond);
   Timestamp(double time);
-  uint32_t ts_sec;
-  uint32_t ts_usec;
-  bool operator==(const Timestamp& other) const;
-  bool operator!=(const Timestamp& other) const;
-  bool operator<(const Timestamp& other) const;  
-  bool operator<=(const Timestamp& other) const;
-  bool operator>(const Timestamp& other) const;  
-  bool operator>=(const Timestamp& other) const;
-  Timestamp& operator+=(Timestamp rhs);
-  Timestamp& operator-=(Timestamp rhs);
-  Timestamp operator-(const Timestamp& other);
-  Timestamp operator+(const Timestamp& other);
+  static Timestamp FromNanoseconds(int64_t ns);
+  // Parse seconds since the epoch, or a local time in the same format as
+  // PrintTime ("YYYY-MM-DD HH:MM:SS[.frac]"). A time of day on its own
+  // ("HH:MM:SS[.frac]") is taken to be on the same day as reference.
+  static Timestamp Parse(const std::string& time, Timestamp reference);
+  int64_t ns;
+  uint32_t Seconds() const;
+  uint32_t Microseconds() const;
+  uint32_t Nanoseconds() const;
+  bool operator==(const Timestamp& other) const { return ns == other.ns; }
+  bool operator!=(const Timestamp& other) const { return ns != other.ns; }
+  bool operator<(const Timestamp& other) const { return ns < other.ns; }
+  bool operator<=(const Timestamp& other) const { return ns <= other.ns; }
+  bool operator>(const Timestamp& other) const { return ns > other.ns; }
+  bool operator>=(const Timestamp& other) const { return ns >= other.ns; }
+  Timestamp& operator+=(Timestamp rhs) { ns += rhs.ns; return *this; }
+  Timestamp& operator-=(Timestamp rhs) { ns -= rhs.ns; return *this; }
+  Timestamp operator-(const Timestamp& other) const;
+  Timestamp operator+(const Timestamp& other) const;
+  Timestamp operator-() const;
   std::string PrintTime() const;
-};
\ No newline at end of file
+};
+
+inline Timestamp Timestamp::FromNanoseconds(int64_t ns) {
+  Timestamp time;
+  time.ns = ns;
+  return time;
+}
+
+inline Timestamp Timestamp::operator-(const Timestamp& other) const {
+  return FromNanoseconds(ns - other.ns);
+}
+
+inline Timestamp Timestamp::operator+(const Timestamp& other) const {
+  return FromNanoseconds(ns + other.ns);
+}
+
+inline Timestamp Timestamp::operator-() const {
+  return FromNanoseconds(-ns);
+}
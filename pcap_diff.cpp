@@ -3,12 +3,17 @@
 #include <vector>
 #include <sstream> 
 #include <iomanip>
+#include <memory>
+#include <limits>
 
 #include <args.h>
 #include <pcap_reader.h>
+#include <capture_set.h>
 #include <packets.h>
 #include <packet_diff.h>
 #include <pcap_writer.h>
+#include <stream_diff.h>
+#include <packet_index.h>
 
 
 std::string print_string_vector(const std::vector<std::string>& vec) {
@@ -22,6 +27,35 @@ std::string print_string_vector(const std::vector<std::string>& vec) {
   return oss.str();
 }
 
+void print_drift(const DriftTracker& drift_tracker) {
+  std::cerr << "\nClock drift: File B skew " << drift_tracker.GetSkewPpm();
+  std::cerr << " ppm (from " << drift_tracker.NumMatches() << " matches)";
+  std::cerr << std::endl;
+}
+
+void print_match_counts(size_t num_match, size_t num_rem, size_t num_add) {
+  std::cerr << "\nMatched: " << std::setw(9) << num_match;
+  std::cerr << " [Packets in both A and B]\n";
+  std::cerr << "Removed: " << std::setw(9) << num_rem;
+  std::cerr << " [Packets in A only]" << std::endl;
+  std::cerr << "Added:   " <<  std::setw(9) << num_add;
+  std::cerr << " [Packets in B only]\n";
+}
+
+// Apply the --start-time/--end-time window to a file. The window is in the
+// same time frame as the output, so the file's time offset is removed.
+void set_time_window(CaptureSet& reader,
+                     const std::pair<Timestamp, Timestamp>& window,
+                     double time_offset) {
+  int64_t offset = time_offset > 0.0 ? Timestamp(time_offset).ns
+                                     : -Timestamp(-time_offset).ns;
+  Timestamp start = window.first;
+  Timestamp end = window.second;
+  if (start.ns != std::numeric_limits<int64_t>::min()) start.ns -= offset;
+  if (end.ns != std::numeric_limits<int64_t>::max()) end.ns -= offset;
+  reader.SetTimeWindow(start, end);
+}
+
 int main(int argc, char* argv[]) {
 
   /****************************************************************************/
@@ -29,9 +63,13 @@ int main(int argc, char* argv[]) {
   /****************************************************************************/
   args::ArgumentParser parser("PCAP Diff Tool");
   args::Positional<std::string> filename_a(
-      parser, "File A", "Filename for file A", {args::Options::Required});
+      parser, "File A", "Filename for file A. A comma separated list or glob "
+                        "pattern reads several files as one capture",
+      {args::Options::Required});
   args::Positional<std::string> filename_b(
-      parser, "File B", "Filename for file B", {args::Options::Required});  
+      parser, "File B", "Filename for file B. A comma separated list or glob "
+                        "pattern reads several files as one capture",
+      {args::Options::Required});
   args::ValueFlag<uint64_t> max_packets(
       parser, "num packets", "Maximum number of packets",
       {"max-packets", 'n'}, 0);
@@ -52,6 +90,12 @@ int main(int argc, char* argv[]) {
   args::ValueFlag<double> time_offset_b(
       parser, "seconds", "Offset applied to file B timestamps",
       {"time-offset-b", 'T'}, 0.0);
+  args::ValueFlag<std::string> start_time(
+      parser, "time", "Only compare packets from this time onwards",
+      {"start-time"});
+  args::ValueFlag<std::string> end_time(
+      parser, "time", "Only compare packets up to this time",
+      {"end-time"});
   args::ValueFlag<double> time_range_min(
       parser, "seconds", "Maximum negative time difference",
       {"neg-time-diff", 'd'}, 0.01);
@@ -59,13 +103,58 @@ int main(int argc, char* argv[]) {
       parser, "seconds", "Maximum positive time difference",
       {"pos-time-diff", 'D'}, 0.01);
   args::ValueFlag<std::string> search_method(
-      parser, "method", "Packet search method: ['timestamp'|'full'|'location']",
-      {"search-method", 'm'}, "timestamp");
+      parser, "method", "Packet search method: ['timestamp'|'full'|'location'|"
+                        "'sequence']",
+      {"search-method", 's'}, "timestamp");
   args::ValueFlag<std::string> output_format(
       parser, "format", "Output format: ['basic'|'full'|'match_a'|'match_b'|"
                         "'added'|'removed']",{"output-format", 'f'}, "basic");
   args::ValueFlag<std::string> output_filename(
         parser, "filename", "Output filename", {"output", 'o'});
+  args::ValueFlag<unsigned int> num_threads(
+      parser, "threads", "Number of threads (Default: hardware concurrency)",
+      {"threads", 'j'}, 0);
+  args::Flag track_drift(
+      parser, "Track drift", "Follow clock drift between the files while "
+                             "matching, keeping the time window centred "
+                             "(timestamp search method only)",
+      {"track-drift"});
+  args::Flag by_flow(
+      parser, "By flow", "Only match packets within the same flow (IP "
+                         "addresses, protocol and ports), searching the "
+                         "flows in parallel",
+      {"by-flow"});
+  args::Flag stream(
+      parser, "Stream", "Stream the files through the timestamp search "
+                        "window instead of loading them into memory",
+      {'S', "stream"});
+  args::Flag use_index(
+      parser, "Index", "Read and write a .pdidx packet index next to each "
+                       "input file, to speed up loading it next time",
+      {'I', "index"});
+  args::ValueFlag<std::string> io_backend(
+      parser, "backend", "How input files are read: ['mmap'|'pread'|'uring']",
+      {"io-backend"}, "mmap");
+  args::Flag direct_io(
+      parser, "Direct I/O", "Bypass the page cache when reading input files "
+                            "(pread and uring backends only)",
+      {"direct-io"});
+  args::ValueFlag<unsigned int> prefetch(
+      parser, "MiB", "Read input files in the background this far ahead of "
+                     "the packet being parsed (Default: kernel readahead)",
+      {"prefetch"}, 0);
+  args::Flag drop_behind(
+      parser, "Drop behind", "Drop input data that has been streamed past "
+                             "from memory and the page cache (--stream only)",
+      {"drop-behind"});
+  args::Flag populate(
+      parser, "Populate", "Read input files into memory when they are mapped "
+                          "(mmap backend only)",
+      {"populate"});
+  args::Flag huge_pages(
+      parser, "Huge pages", "Use transparent huge pages for input data "
+                            "where possible",
+      {"huge-pages"});
   args::Flag verbose(
       parser,"Verbose", "Print verbose output", {'v', "verbose"});
   args::HelpFlag help(
@@ -101,7 +190,8 @@ int main(int argc, char* argv[]) {
     return 2;
   }
 
-  std::vector<std::string> search_methods{"timestamp", "full", "location"};
+  std::vector<std::string> search_methods{"timestamp", "full", "location",
+                                          "sequence"};
   if (std::find(search_methods.begin(), search_methods.end(),
                 args::get(search_method)) == search_methods.end()) {
     std::cerr << "Search method must be one of the following options: ";
@@ -109,27 +199,227 @@ int main(int argc, char* argv[]) {
     return 2;
   }
 
+  if (track_drift && args::get(search_method) != "timestamp") {
+    std::cerr << "--track-drift is only supported by the 'timestamp' "
+                 "search method" << std::endl;
+    return 2;
+  }
+
+  if (by_flow && (args::get(search_method) == "location" || track_drift ||
+                  stream)) {
+    std::cerr << "--by-flow can't be used with the 'location' search "
+                 "method, --track-drift or --stream" << std::endl;
+    return 2;
+  }
+
+  if (args::get(filename_a) == "-" && args::get(filename_b) == "-") {
+    std::cerr << "Only one of File A and File B can be read from stdin"
+              << std::endl;
+    return 2;
+  }
+
+  /****************************************************************************/
+  /*                              Open input files                            */
+  /****************************************************************************/
+  // Each file is only opened once, as it may be a pipe that can only be
+  // read once. "-" reads from stdin.
+  std::unique_ptr<CaptureSet> pcap_a, pcap_b;
+  try {
+    IoBackend::Options io_options{IoBackend::Parse(args::get(io_backend)),
+                                  direct_io, populate, huge_pages, stream};
+    if (direct_io && io_options.type == IoBackend::Type::Mmap) {
+      std::cerr << "--direct-io requires the 'pread' or 'uring' I/O backend"
+                << std::endl;
+      return 2;
+    }
+    if (populate && io_options.type != IoBackend::Type::Mmap) {
+      std::cerr << "--populate requires the 'mmap' I/O backend" << std::endl;
+      return 2;
+    }
+    if (drop_behind && !stream) {
+      std::cerr << "--drop-behind requires --stream" << std::endl;
+      return 2;
+    }
+    if (verbose) std::cerr << "Opening File A: " << args::get(filename_a);
+    pcap_a.reset(new CaptureSet(CaptureSet::ExpandPaths(args::get(filename_a)),
+                                io_options));
+    if (verbose) std::cerr << " - Done" << std::endl;
+    if (verbose) std::cerr << "Opening File B: " << args::get(filename_b);
+    pcap_b.reset(new CaptureSet(CaptureSet::ExpandPaths(args::get(filename_b)),
+                                io_options));
+    if (verbose) std::cerr << " - Done" << std::endl;
+    size_t prefetch_bytes = static_cast<size_t>(args::get(prefetch)) << 20;
+    pcap_a->SetPrefetch(prefetch_bytes);
+    pcap_b->SetPrefetch(prefetch_bytes);
+  } catch (const std::runtime_error& error) {
+    std::cerr << "\nERROR: " << error.what() << std::endl;
+    return 2;
+  }
+
+  /****************************************************************************/
+  /*                               Time window                                */
+  /****************************************************************************/
+  // A time of day on its own is on the same day as the first packet in A
+  bool windowed = start_time || end_time;
+  std::pair<Timestamp, Timestamp> time_window{
+      Timestamp::FromNanoseconds(std::numeric_limits<int64_t>::min()),
+      Timestamp::FromNanoseconds(std::numeric_limits<int64_t>::max())};
+  if (windowed) {
+    try {
+      CaptureSet::Cursor cursor = pcap_a->Begin();
+      Packet first_packet{Timestamp(), 0, nullptr};
+      pcap_a->Next(cursor, first_packet);
+      if (start_time) {
+        time_window.first = Timestamp::Parse(args::get(start_time),
+                                             first_packet.time);
+      }
+      if (end_time) {
+        time_window.second = Timestamp::Parse(args::get(end_time),
+                                              first_packet.time);
+      }
+    } catch (const std::runtime_error& error) {
+      std::cerr << "\nERROR: " << error.what() << std::endl;
+      return 2;
+    }
+    if (time_window.second < time_window.first) {
+      std::cerr << "--end-time must not be before --start-time" << std::endl;
+      return 2;
+    }
+  }
+
+  /****************************************************************************/
+  /*                        Streaming timestamp search                        */
+  /****************************************************************************/
+  if (stream) {
+    if (args::get(search_method) != "timestamp") {
+      std::cerr << "--stream is only supported by the 'timestamp' "
+                   "search method" << std::endl;
+      return 2;
+    }
+    if (auto_timestamp_align) {
+      std::cerr << "--stream and --auto-time-align are mutually exclusive "
+                   "options" << std::endl;
+      return 2;
+    }
+    if (use_index) {
+      std::cerr << "--stream and --index are mutually exclusive "
+                   "options" << std::endl;
+      return 2;
+    }
+    try {
+      if (windowed) {
+        set_time_window(*pcap_a, time_window, args::get(time_offset_a));
+        set_time_window(*pcap_b, time_window, args::get(time_offset_b));
+      }
+      if (args::get(output_format) == "basic" &&
+          pcap_a->GetLinkLayer() != pcap_b->GetLinkLayer()) {
+        std::cerr << "PCAP Link layer of File A and File B differs. "
+                     "The 'basic' output format requires that they match. "
+                     "Select a different output mode." << std::endl;
+        return 2;
+      }
+      PacketDiff packet_diff(args::get(search_method),
+                             args::get(byte_mask),
+                             args::get(byte_range_a),
+                             args::get(byte_range_b),{
+                             args::get(time_range_min),
+                             args::get(time_range_max)}, 1);
+      packet_diff.SetTrackDrift(track_drift);
+      StreamDiff stream_diff(packet_diff, *pcap_a, *pcap_b,
+                             args::get(max_packets),
+                             args::get(time_offset_a),
+                             args::get(time_offset_b));
+      stream_diff.SetDropBehind(drop_behind);
+      std::unique_ptr<PcapWriter::StreamWriter> writer;
+      if (output_filename) {
+        if (verbose) {
+          std::cerr << "Writing file: " << args::get(output_filename);
+          std::cerr << std::endl;
+        }
+        writer.reset(new PcapWriter::StreamWriter(
+            args::get(output_filename), args::get(output_format),
+            pcap_a->GetLinkLayer(), pcap_b->GetLinkLayer(),
+            pcap_a->IsNanosecond(), pcap_b->IsNanosecond()));
+      }
+      stream_diff.Run(writer.get());
+      if (writer) {
+        writer->Close();
+      }
+      if (verbose && track_drift) {
+        print_drift(stream_diff.GetDriftTracker());
+      }
+      if (verbose) {
+        print_match_counts(stream_diff.NumMatched(), stream_diff.NumRemoved(),
+                           stream_diff.NumAdded());
+      }
+      // Return 0 if PCAPs match, 1 if they differ
+      return (stream_diff.NumRemoved() == 0 &&
+              stream_diff.NumAdded() == 0) ? 0 : 1;
+    } catch (const std::runtime_error& error) {
+      std::cerr << "\nERROR: " << error.what() << std::endl;
+      return 2;
+    }
+  }
+
   /****************************************************************************/
   /*                         Load packets from file                           */
   /****************************************************************************/
 
   Packets packets_a, packets_b;
+  // An index is rewritten if it was missing, out of date, or has gained
+  // the packet hashes during this run
+  bool indexed_a = false;
+  bool indexed_b = false;
+  bool indexed_hashes_a = false;
+  bool indexed_hashes_b = false;
+  uint64_t settings_key_a = 0;
+  uint64_t settings_key_b = 0;
   try {
     {
       if (verbose) std::cerr << "Reading File A: " << args::get(filename_a);
-      PcapReader pcap(args::get(filename_a));
-      packets_a.Load(
-        pcap.GetPackets(args::get(max_packets)), pcap.GetLinkLayer()
-      );
-      if (verbose) std::cerr << " - Done" << std::endl;
+      CaptureSet& pcap = *pcap_a;
+      if (windowed) {
+        set_time_window(pcap, time_window, args::get(time_offset_a));
+      }
+      // Indexes cover whole files, so aren't used with a time window or
+      // a set of files
+      if (use_index && !windowed && pcap.NumFiles() == 1) {
+        settings_key_a = PacketDiff::GetSettingsKey(args::get(byte_mask),
+                                                    args::get(byte_range_a));
+        indexed_a = packets_a.LoadIndex(
+            pcap.GetReader(0),
+            PacketIndex::GetPath(pcap.GetReader(0).GetFilename()),
+            settings_key_a, args::get(max_packets));
+        indexed_hashes_a = indexed_a && packets_a.HasHashes();
+      }
+      if (!indexed_a) {
+        packets_a.Load(pcap, args::get(max_packets), args::get(num_threads));
+      }
+      if (verbose) std::cerr << (indexed_a ? " - Done (index)" : " - Done");
+      if (verbose) std::cerr << std::endl;
     }
     {
       if (verbose) std::cerr << "Reading File B: " << args::get(filename_b);
-      PcapReader pcap(args::get(filename_b));
-      packets_b.Load(
-        pcap.GetPackets(args::get(max_packets)), pcap.GetLinkLayer()
-      );
-      if (verbose) std::cerr << " - Done" << std::endl;
+      CaptureSet& pcap = *pcap_b;
+      if (windowed) {
+        set_time_window(pcap, time_window, args::get(time_offset_b));
+      }
+      // Indexes cover whole files, so aren't used with a time window or
+      // a set of files
+      if (use_index && !windowed && pcap.NumFiles() == 1) {
+        settings_key_b = PacketDiff::GetSettingsKey(args::get(byte_mask),
+                                                    args::get(byte_range_b));
+        indexed_b = packets_b.LoadIndex(
+            pcap.GetReader(0),
+            PacketIndex::GetPath(pcap.GetReader(0).GetFilename()),
+            settings_key_b, args::get(max_packets));
+        indexed_hashes_b = indexed_b && packets_b.HasHashes();
+      }
+      if (!indexed_b) {
+        packets_b.Load(pcap, args::get(max_packets), args::get(num_threads));
+      }
+      if (verbose) std::cerr << (indexed_b ? " - Done (index)" : " - Done");
+      if (verbose) std::cerr << std::endl;
     }
   }
   catch (const std::runtime_error& error) {
@@ -140,6 +430,10 @@ int main(int argc, char* argv[]) {
   if (verbose) {
     std::cerr << "\nFile A - " << packets_a.GetMetadataString() << std::endl;
     std::cerr << "File B - " << packets_b.GetMetadataString() << std::endl;
+    std::cerr << "Compare kernel: " << MaskedCompare::SelectedName();
+    std::cerr << std::endl;
+    std::cerr << "Hash kernel: " << ContentHash::SelectedName();
+    std::cerr << std::endl;
   }
 
   if (args::get(output_format) == "basic") {
@@ -151,6 +445,22 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  std::unique_ptr<PacketDiff> packet_diff;
+  try {
+    packet_diff.reset(new PacketDiff(args::get(search_method),
+                                     args::get(byte_mask),
+                                     args::get(byte_range_a),
+                                     args::get(byte_range_b),{
+                                     args::get(time_range_min),
+                                     args::get(time_range_max)},
+                                     args::get(num_threads)));
+    packet_diff->SetTrackDrift(track_drift);
+    packet_diff->SetMatchByFlow(by_flow);
+  } catch (const std::runtime_error& error) {
+    std::cerr << "\nERROR: " << error.what() << std::endl;
+    return 2;
+  }
+
   /****************************************************************************/
   /*                            Adjust Timestamps                             */
   /****************************************************************************/
@@ -158,9 +468,21 @@ int main(int argc, char* argv[]) {
   double offset_b = args::get(time_offset_b);
 
   if (auto_timestamp_align) {
-    std::cerr << "Auto timestamp alignment is currently unsupported";
-    std::cerr << std::endl;
-    return 2;
+    PacketDiff::TimeAlignment alignment =
+        packet_diff->EstimateTimeOffset(packets_a, packets_b);
+    if (alignment.num_pairs == 0) {
+      std::cerr << "\nWARNING: Auto time align found no identical packets. "
+                   "No time offset applied." << std::endl;
+    }
+    offset_b = alignment.offset_ns / 1e9;
+    if (verbose && alignment.num_pairs != 0) {
+      std::cerr << "\nAuto time align: File B offset " << offset_b;
+      std::cerr << " seconds. Confidence: " << std::setprecision(3);
+      std::cerr << 100.0 * alignment.num_agreeing / alignment.num_pairs;
+      std::cerr << std::setprecision(6) << "% (" << alignment.num_agreeing;
+      std::cerr << " of " << alignment.num_pairs << " sampled pairs)";
+      std::cerr << std::endl;
+    }
   }
 
   packets_a.OffsetTimestamps(offset_a);
@@ -181,29 +503,44 @@ int main(int argc, char* argv[]) {
   /*                            Compare packets                               */
   /****************************************************************************/
   try {
-    PacketDiff packet_diff(args::get(search_method),
-                           args::get(byte_mask),
-                           args::get(byte_range_a),
-                           args::get(byte_range_b),{
-                           args::get(time_range_min),
-                           args::get(time_range_max)});
-    packet_diff.FindMatching(packets_a, packets_b);
+    packet_diff->FindMatching(packets_a, packets_b);
+    if (verbose && track_drift) {
+      print_drift(packet_diff->GetDriftTracker());
+    }
   } catch (const std::runtime_error& error) {
     std::cerr << "\nERROR: " << error.what() << std::endl;
     return 2;
   }
 
-  auto no_match = [](const Packet& packet) {return !packet.match;};
-  size_t num_rem = std::count_if(packets_a.begin(), packets_a.end(), no_match);
-  size_t num_add = std::count_if(packets_b.begin(), packets_b.end(), no_match);
+  /****************************************************************************/
+  /*                           Update packet indexes                          */
+  /****************************************************************************/
+  // Only complete files are indexed. Failing to write an index does not
+  // affect the result, so it is only a warning.
+  if (use_index && args::get(max_packets) == 0 && !windowed) {
+    try {
+      if (pcap_a->NumFiles() == 1 &&
+          (!indexed_a || packets_a.HasHashes() != indexed_hashes_a)) {
+        const std::string& path = pcap_a->GetReader(0).GetFilename();
+        packets_a.SaveIndex(path, PacketIndex::GetPath(path),
+                            settings_key_a);
+      }
+      if (pcap_b->NumFiles() == 1 &&
+          (!indexed_b || packets_b.HasHashes() != indexed_hashes_b)) {
+        const std::string& path = pcap_b->GetReader(0).GetFilename();
+        packets_b.SaveIndex(path, PacketIndex::GetPath(path),
+                            settings_key_b);
+      }
+    } catch (const std::runtime_error& error) {
+      std::cerr << "\nWARNING: Packet index not saved. " << error.what();
+      std::cerr << std::endl;
+    }
+  }
+
+  size_t num_rem = packets_a.Size() - packets_a.NumMatched();
+  size_t num_add = packets_b.Size() - packets_b.NumMatched();
   if (verbose) {
-    size_t num_match = packets_a.Size() - num_rem;
-    std::cerr << "\nMatched: " << std::setw(9) << num_match;
-    std::cerr << " [Packets in both A and B]\n";
-    std::cerr << "Removed: " << std::setw(9) << num_rem;
-    std::cerr << " [Packets in A only]" << std::endl;
-    std::cerr << "Added:   " <<  std::setw(9) << num_add;
-    std::cerr << " [Packets in B only]\n";
+    print_match_counts(packets_a.Size() - num_rem, num_rem, num_add);
   }
 
   /****************************************************************************/
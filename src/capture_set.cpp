@@ -0,0 +1,160 @@
+#include <stdexcept>
+#include <algorithm>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include <capture_set.h>
+
+
+namespace {
+
+  // Heap order for CaptureSet::Cursor::heap. std::push_heap keeps the
+  // largest element first, so the later packet compares as smaller. Ties go
+  // to the earlier file, so files listed in order stay in order.
+  struct Later {
+    const std::vector<Packet>& next;
+    bool operator()(size_t a, size_t b) const {
+      if (next[a].time == next[b].time) {
+        return a > b;
+      }
+      return next[a].time > next[b].time;
+    }
+  };
+
+}
+
+std::vector<std::string> CaptureSet::ExpandPaths(const std::string& paths) {
+  struct stat sb;
+  if (paths == "-" || stat(paths.c_str(), &sb) == 0) {
+    return {paths};
+  }
+
+  std::vector<std::string> expanded;
+  size_t start = 0;
+  while (start <= paths.size()) {
+    size_t end = std::min(paths.find(',', start), paths.size());
+    std::string path = paths.substr(start, end - start);
+    start = end + 1;
+    if (path.empty()) {
+      continue;
+    }
+    if (path.find_first_of("*?[") == std::string::npos) {
+      expanded.push_back(path);
+      continue;
+    }
+    glob_t matches;
+    int result = glob(path.c_str(), 0, nullptr, &matches);
+    if (result == 0) {
+      expanded.insert(expanded.end(), matches.gl_pathv,
+                      matches.gl_pathv + matches.gl_pathc);
+    }
+    globfree(&matches);
+    if (result == GLOB_NOMATCH) {
+      throw std::runtime_error("Failed to open file: " + path + "\n"
+                               "No files match the pattern.");
+    } else if (result != 0) {
+      throw std::runtime_error("Failed to open file: " + path);
+    }
+  }
+  if (expanded.empty()) {
+    throw std::runtime_error("Failed to open file: " + paths);
+  }
+  return expanded;
+}
+
+CaptureSet::CaptureSet(const std::vector<std::string>& paths,
+                       const IoBackend::Options& io_options) {
+  readers_.reserve(paths.size());
+  for (const auto& path : paths) {
+    readers_.emplace_back(path, io_options);
+    if (readers_.back().GetLinkLayer() != readers_.front().GetLinkLayer()) {
+      throw std::runtime_error("Failed to parse file: " + path + "\n"
+                               "Link layer differs from the other files "
+                               "in the set: " + GetFilename());
+    }
+  }
+}
+
+void CaptureSet::SetTimeWindow(Timestamp start, Timestamp end) {
+  for (auto& reader : readers_) {
+    reader.SetTimeWindow(start, end);
+  }
+}
+
+void CaptureSet::SetPrefetch(size_t distance) {
+  for (auto& reader : readers_) {
+    reader.SetPrefetch(distance);
+  }
+}
+
+CaptureSet::Cursor CaptureSet::Begin() const {
+  Cursor cursor;
+  cursor.index = 0;
+  cursor.next.resize(readers_.size(), Packet{Timestamp(), 0, nullptr});
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    cursor.cursors.push_back(readers_[i].Begin());
+    if (readers_[i].Next(cursor.cursors[i], cursor.next[i])) {
+      cursor.heap.push_back(i);
+    }
+  }
+  std::make_heap(cursor.heap.begin(), cursor.heap.end(), Later{cursor.next});
+  return cursor;
+}
+
+bool CaptureSet::Next(Cursor& cursor, Packet& packet) const {
+  if (cursor.heap.empty()) {
+    return false;
+  }
+  Later later{cursor.next};
+  std::pop_heap(cursor.heap.begin(), cursor.heap.end(), later);
+  size_t file = cursor.heap.back();
+  packet = cursor.next[file];
+  if (readers_[file].Next(cursor.cursors[file], cursor.next[file])) {
+    std::push_heap(cursor.heap.begin(), cursor.heap.end(), later);
+  } else {
+    cursor.heap.pop_back();
+  }
+  cursor.index++;
+  return true;
+}
+
+size_t CaptureSet::NumFiles() const {
+  return readers_.size();
+}
+
+const PcapReader& CaptureSet::GetReader(size_t index) const {
+  return readers_[index];
+}
+
+size_t CaptureSet::FindFile(const uint8_t* data, size_t& offset) const {
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    if (readers_[i].FindOffset(data, offset)) {
+      return i;
+    }
+  }
+  throw std::runtime_error("Packet data is not from any file in the set.");
+}
+
+uint32_t CaptureSet::GetLinkLayer() const {
+  return readers_.front().GetLinkLayer();
+}
+
+bool CaptureSet::IsNanosecond() const {
+  for (const auto& reader : readers_) {
+    if (reader.IsNanosecond()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string CaptureSet::GetFilename() const {
+  std::string filename;
+  for (const auto& reader : readers_) {
+    if (!filename.empty()) {
+      filename += ", ";
+    }
+    filename += reader.GetFilename();
+  }
+  return filename;
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PCAP_DIFF_X86_64
+#endif
+
+#include <content_hash.h>
+
+
+namespace {
+
+  constexpr uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+
+  inline uint64_t Load(const uint8_t* data) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    return word;
+  }
+
+  // count (at most 8) bytes from data + index, zero filled to a word, with
+  // the mask applied to the bytes before mask_length
+  inline uint64_t LoadPartial(const uint8_t* data, size_t index,
+                              size_t count, const uint8_t* mask,
+                              size_t mask_length) {
+    uint8_t bytes[sizeof(uint64_t)] = {};
+    for (size_t i = 0; i < count; ++i) {
+      bytes[i] = data[index + i];
+      if (index + i < mask_length) {
+        bytes[i] &= mask[index + i];
+      }
+    }
+    return Load(bytes);
+  }
+
+  // Word at a time multiply and shift hash
+  uint64_t HashScalar(const uint8_t* data, size_t length,
+                      const uint8_t* mask, size_t mask_length) {
+    uint64_t hash = length * kMultiplier;
+    auto mix = [&hash](uint64_t word) {
+      hash = (hash ^ word) * kMultiplier;
+      hash ^= hash >> 29;
+    };
+    size_t i = 0;
+    size_t masked = std::min(length, mask_length);
+    for (; i + 8 <= masked; i += 8) {
+      mix(Load(data + i) & Load(mask + i));
+    }
+    if (i < masked) {
+      size_t count = std::min<size_t>(8, length - i);
+      mix(LoadPartial(data, i, count, mask, mask_length));
+      i += count;
+    }
+    for (; i + 8 <= length; i += 8) {
+      mix(Load(data + i));
+    }
+    if (i < length) {
+      mix(LoadPartial(data, i, length - i, mask, 0));
+    }
+    return hash ^ (hash >> 32);
+  }
+
+#ifdef PCAP_DIFF_X86_64
+  // CRC32C of the data in two lanes with different seeds, which together
+  // give 64 bits. The lanes don't depend on each other, so the crc32
+  // instructions overlap rather than waiting for the previous result.
+  __attribute__((target("sse4.2")))
+  uint64_t HashCrc32c(const uint8_t* data, size_t length,
+                      const uint8_t* mask, size_t mask_length) {
+    unsigned long long low = 0x6A09E667;
+    unsigned long long high = 0xBB67AE85;
+    size_t i = 0;
+    size_t masked = std::min(length, mask_length);
+    for (; i + 8 <= masked; i += 8) {
+      low = _mm_crc32_u64(low, Load(data + i) & Load(mask + i));
+    }
+    if (i < masked) {
+      size_t count = std::min<size_t>(8, length - i);
+      high = _mm_crc32_u64(high, LoadPartial(data, i, count, mask,
+                                             mask_length));
+      i += count;
+    }
+    for (; i + 16 <= length; i += 16) {
+      low = _mm_crc32_u64(low, Load(data + i));
+      high = _mm_crc32_u64(high, Load(data + i + 8));
+    }
+    if (i + 8 <= length) {
+      low = _mm_crc32_u64(low, Load(data + i));
+      i += 8;
+    }
+    if (i < length) {
+      high = _mm_crc32_u64(high, LoadPartial(data, i, length - i, mask, 0));
+    }
+    uint64_t hash = ((static_cast<uint64_t>(high) << 32) | low) ^
+                    (length * kMultiplier);
+    hash *= kMultiplier;
+    return hash ^ (hash >> 32);
+  }
+#endif
+
+}
+
+ContentHash::Function ContentHash::Select() {
+#ifdef PCAP_DIFF_X86_64
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return HashCrc32c;
+  }
+#endif
+  return HashScalar;
+}
+
+const char* ContentHash::SelectedName() {
+  Function function = Select();
+#ifdef PCAP_DIFF_X86_64
+  if (function == HashCrc32c) return "CRC32C";
+#endif
+  (void)function;
+  return "Scalar";
+}
@@ -0,0 +1,473 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+
+#ifdef PCAP_DIFF_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PCAP_DIFF_ZSTD
+#include <zstd.h>
+#endif
+#ifdef PCAP_DIFF_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <decompressor.h>
+
+
+namespace {
+
+  // Most output decoded in one step
+  constexpr size_t kBufferSize = 8 * 1024 * 1024;
+  // Longest wait for a pipe before checking if reading has been cancelled
+  constexpr int kPollMilliseconds = 100;
+
+  /**
+   * @brief Streaming decoder for one compression format
+   * 
+   * Read fills out with up to capacity decompressed bytes, and returns
+   * the number written. It returns 0 once all the input is decoded.
+   */
+  using Codec = InputStream::Producer;
+
+  /**
+   * @brief Compressed input, handed to a codec one piece at a time
+   */
+  class Source {
+    public:
+      virtual ~Source() {}
+      // Sets data to the next piece of the input and returns its length, or
+      // 0 at the end of the input. The previous piece is no longer needed.
+      virtual size_t Next(const uint8_t*& data) = 0;
+      virtual void Cancel() {}
+  };
+
+  // Input that is already in memory, such as a mapped file. file, if set,
+  // is kept open while the input is decoded.
+  class MemorySource : public Source {
+    public:
+      MemorySource(const uint8_t* data, size_t size,
+                   std::shared_ptr<const MappedFile> file = nullptr)
+          : data_(data), size_(size), file_(std::move(file)) {}
+      size_t Next(const uint8_t*& data) override {
+        data = data_;
+        size_t size = size_;
+        size_ = 0;
+        return size;
+      }
+    private:
+      const uint8_t* data_;
+      size_t size_;
+      std::shared_ptr<const MappedFile> file_;
+  };
+
+  // Input that is still being read, such as a pipe. Each piece is released
+  // once the codec has moved past it.
+  class StreamSource : public Source {
+    public:
+      explicit StreamSource(std::shared_ptr<InputStream> input)
+          : input_(std::move(input)), offset_(0) {}
+      size_t Next(const uint8_t*& data) override {
+        input_->Release(offset_);
+        size_t length = input_->GetPiece(offset_, data);
+        offset_ += length;
+        return length;
+      }
+      void Cancel() override {
+        input_->Cancel();
+      }
+    private:
+      std::shared_ptr<InputStream> input_;
+      size_t offset_;
+  };
+
+#ifdef PCAP_DIFF_ZLIB
+  class GzipCodec : public Codec {
+    public:
+      explicit GzipCodec(std::unique_ptr<Source> source)
+          : source_(std::move(source)), next_(nullptr), remaining_(0),
+            finished_(false) {
+        std::memset(&stream_, 0, sizeof(stream_));
+        // 15 + 32: maximum window size, with a gzip or zlib header
+        if (inflateInit2(&stream_, 15 + 32) != Z_OK) {
+          throw std::runtime_error("Failed to initialise zlib.");
+        }
+      }
+      ~GzipCodec() override {
+        inflateEnd(&stream_);
+      }
+      size_t Read(uint8_t* out, size_t capacity) override {
+        stream_.next_out = out;
+        stream_.avail_out = static_cast<uInt>(capacity);
+        while (stream_.avail_out > 0 && !finished_) {
+          bool more = Refill();
+          int result = inflate(&stream_, Z_NO_FLUSH);
+          if (result == Z_STREAM_END) {
+            // A gzip file may hold several members one after the other
+            if (!Refill()) {
+              finished_ = true;
+            } else if (inflateReset(&stream_) != Z_OK) {
+              throw std::runtime_error("gzip data is corrupt.");
+            }
+          } else if (result != Z_OK && !(result == Z_BUF_ERROR && !more)) {
+            throw std::runtime_error("gzip data is corrupt.");
+          } else if (!more && stream_.avail_out > 0) {
+            throw std::runtime_error("gzip data is truncated.");
+          }
+        }
+        return capacity - stream_.avail_out;
+      }
+      void Cancel() override {
+        source_->Cancel();
+      }
+    private:
+      // Gives zlib more input once it has used what it had. Returns false
+      // at the end of the input.
+      bool Refill() {
+        if (stream_.avail_in != 0) {
+          return true;
+        }
+        if (remaining_ == 0) {
+          remaining_ = source_->Next(next_);
+          if (remaining_ == 0) {
+            return false;
+          }
+        }
+        // avail_in is 32 bits, so large pieces are fed in parts
+        stream_.next_in = const_cast<Bytef*>(next_);
+        stream_.avail_in = static_cast<uInt>(
+            std::min<size_t>(remaining_, UINT32_MAX));
+        next_ += stream_.avail_in;
+        remaining_ -= stream_.avail_in;
+        return true;
+      }
+
+      std::unique_ptr<Source> source_;
+      z_stream stream_;
+      const uint8_t* next_;
+      size_t remaining_;
+      bool finished_;
+  };
+#endif
+
+#ifdef PCAP_DIFF_ZSTD
+  class ZstdCodec : public Codec {
+    public:
+      explicit ZstdCodec(std::unique_ptr<Source> source)
+          : source_(std::move(source)), stream_(ZSTD_createDStream()),
+            input_{nullptr, 0, 0}, frame_finished_(true) {
+        if (stream_ == nullptr) {
+          throw std::runtime_error("Failed to initialise zstd.");
+        }
+      }
+      ~ZstdCodec() override {
+        ZSTD_freeDStream(stream_);
+      }
+      size_t Read(uint8_t* out, size_t capacity) override {
+        ZSTD_outBuffer output{out, capacity, 0};
+        while (output.pos < output.size) {
+          if (input_.pos == input_.size) {
+            const uint8_t* data;
+            input_.size = source_->Next(data);
+            input_.src = data;
+            input_.pos = 0;
+            if (input_.size == 0) {
+              break;
+            }
+          }
+          size_t result = ZSTD_decompressStream(stream_, &output, &input_);
+          if (ZSTD_isError(result)) {
+            throw std::runtime_error(std::string("zstd data is corrupt. ") +
+                                     ZSTD_getErrorName(result));
+          }
+          frame_finished_ = result == 0;
+        }
+        // Data still buffered in the decoder is flushed by the next call
+        if (output.pos == 0 && input_.pos == input_.size && !frame_finished_) {
+          size_t result = ZSTD_decompressStream(stream_, &output, &input_);
+          if (ZSTD_isError(result) || output.pos == 0) {
+            throw std::runtime_error("zstd data is truncated.");
+          }
+          frame_finished_ = result == 0;
+        }
+        return output.pos;
+      }
+      void Cancel() override {
+        source_->Cancel();
+      }
+    private:
+      std::unique_ptr<Source> source_;
+      ZSTD_DStream* stream_;
+      ZSTD_inBuffer input_;
+      bool frame_finished_;
+  };
+#endif
+
+#ifdef PCAP_DIFF_LZ4
+  class Lz4Codec : public Codec {
+    public:
+      explicit Lz4Codec(std::unique_ptr<Source> source)
+          : source_(std::move(source)), context_(nullptr), data_(nullptr),
+            remaining_(0), frame_finished_(true) {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&context_,
+                                                         LZ4F_VERSION))) {
+          throw std::runtime_error("Failed to initialise lz4.");
+        }
+      }
+      ~Lz4Codec() override {
+        LZ4F_freeDecompressionContext(context_);
+      }
+      size_t Read(uint8_t* out, size_t capacity) override {
+        size_t written = 0;
+        while (written < capacity) {
+          if (remaining_ == 0) {
+            remaining_ = source_->Next(data_);
+          }
+          // A finished frame leaves nothing buffered in the decoder
+          if (remaining_ == 0 && frame_finished_) {
+            break;
+          }
+          size_t out_size = capacity - written;
+          size_t in_size = remaining_;
+          size_t result = LZ4F_decompress(context_, out + written, &out_size,
+                                          data_, &in_size, nullptr);
+          if (LZ4F_isError(result)) {
+            throw std::runtime_error(std::string("lz4 data is corrupt. ") +
+                                     LZ4F_getErrorName(result));
+          }
+          data_ += in_size;
+          remaining_ -= in_size;
+          written += out_size;
+          frame_finished_ = result == 0;
+          if (out_size == 0 && in_size == 0) {
+            throw std::runtime_error("lz4 data is truncated.");
+          }
+        }
+        return written;
+      }
+      void Cancel() override {
+        source_->Cancel();
+      }
+    private:
+      std::unique_ptr<Source> source_;
+      LZ4F_dctx* context_;
+      const uint8_t* data_;
+      size_t remaining_;
+      bool frame_finished_;
+  };
+#endif
+
+  // Not compressed, just read from a pipe or other stream with large reads
+  class StreamCodec : public Codec {
+    public:
+      // An owned fd is closed when the codec is destroyed
+      StreamCodec(int fd, bool owned)
+          : fd_(fd), owned_(owned), cancelled_(false) {}
+      ~StreamCodec() override {
+        if (owned_) {
+          close(fd_);
+        }
+      }
+      size_t Read(uint8_t* out, size_t capacity) override {
+        // Waits in short steps, so a cancel is noticed while a live capture
+        // has nothing to send
+        while (!cancelled_) {
+          pollfd poll_fd{fd_, POLLIN, 0};
+          int ready = poll(&poll_fd, 1, kPollMilliseconds);
+          if (ready == -1 && errno != EINTR) {
+            throw std::runtime_error(std::string("Read failed. ") +
+                                     std::strerror(errno));
+          }
+          if (ready <= 0) {
+            continue;
+          }
+          ssize_t length = read(fd_, out, capacity);
+          if (length == -1 && errno == EINTR) {
+            continue;
+          }
+          if (length == -1) {
+            throw std::runtime_error(std::string("Read failed. ") +
+                                     std::strerror(errno));
+          }
+          return static_cast<size_t>(length);
+        }
+        return 0;
+      }
+      void Cancel() override {
+        cancelled_ = true;
+      }
+    private:
+      int fd_;
+      bool owned_;
+      std::atomic<bool> cancelled_;
+  };
+
+  std::unique_ptr<Codec> MakeCodec(Decompressor::Format format,
+                                   std::unique_ptr<Source> source) {
+    switch (format) {
+#ifdef PCAP_DIFF_ZLIB
+      case Decompressor::Format::Gzip:
+        return std::unique_ptr<Codec>(new GzipCodec(std::move(source)));
+#endif
+#ifdef PCAP_DIFF_ZSTD
+      case Decompressor::Format::Zstd:
+        return std::unique_ptr<Codec>(new ZstdCodec(std::move(source)));
+#endif
+#ifdef PCAP_DIFF_LZ4
+      case Decompressor::Format::Lz4:
+        return std::unique_ptr<Codec>(new Lz4Codec(std::move(source)));
+#endif
+      default:
+        (void)source;
+        return nullptr;
+    }
+  }
+
+  void CheckSupported(Decompressor::Format format, const Codec* codec,
+                      const std::string& path) {
+    if (codec == nullptr) {
+      throw std::runtime_error("Failed to parse file: " + path + "\n"
+                               "File is " +
+                               Decompressor::FormatName(format) +
+                               " compressed, but this program was built "
+                               "without " + Decompressor::FormatName(format) +
+                               " support.");
+    }
+  }
+
+  // Use the decompressed size recorded in the file, where there is one
+  size_t GetSizeHint(Decompressor::Format format, const MappedFile& file) {
+    size_t hint = 0;
+    if (format == Decompressor::Format::Gzip && file.Size() >= 18) {
+      // ISIZE: the size modulo 2^32 of the last member
+      uint32_t size;
+      std::memcpy(&size, file.Data() + file.Size() - 4, sizeof(uint32_t));
+      hint = size;
+    }
+#ifdef PCAP_DIFF_ZSTD
+    if (format == Decompressor::Format::Zstd) {
+      unsigned long long size = ZSTD_getFrameContentSize(file.Data(),
+                                                         file.Size());
+      if (size != ZSTD_CONTENTSIZE_UNKNOWN &&
+          size != ZSTD_CONTENTSIZE_ERROR) {
+        hint = size;
+      }
+    }
+#endif
+    // Never smaller than the input, as captures rarely compress below 2:1
+    return std::max(hint, file.Size() * 2) + kBufferSize;
+  }
+
+  // Runs the codec on the calling thread, decoding straight into one block
+  // of memory. A separate thread would only feed a copy into the block, and
+  // nothing can be parsed until the whole input has been decoded.
+  std::shared_ptr<const MappedFile> Collect(Codec& codec, size_t size_hint,
+                                            const std::string& path) {
+    // The output grows by at least half each time it fills, so its
+    // contents are only moved a few times
+    std::shared_ptr<MappedFile> output;
+    size_t length = 0;
+    try {
+      output = std::make_shared<MappedFile>(MappedFile::Anonymous(size_hint));
+      size_t read;
+      do {
+        if (output->Size() - length < kBufferSize) {
+          output->Resize(std::max(output->Size() + output->Size() / 2,
+                                  length + kBufferSize));
+        }
+        read = codec.Read(output->DataWritable() + length, kBufferSize);
+        length += read;
+      } while (read > 0);
+    } catch (const std::runtime_error& error) {
+      throw std::runtime_error("Failed to parse file: " + path + "\n" +
+                               error.what());
+    }
+
+    if (length == 0) {
+      throw std::runtime_error("Failed to parse file: " + path + "\n"
+                               "File is too small to be a PCAP file.");
+    }
+    output->Resize(length);
+    return output;
+  }
+
+}
+
+Decompressor::Format Decompressor::DetectFormat(const MappedFile& file) {
+  return DetectFormat(file.Data(), file.Size());
+}
+
+Decompressor::Format Decompressor::DetectFormat(const uint8_t* data,
+                                                size_t size) {
+  if (size < 4) {
+    return Format::None;
+  }
+  uint32_t magic;
+  std::memcpy(&magic, data, sizeof(uint32_t));
+  if (data[0] == 0x1F && data[1] == 0x8B) {
+    return Format::Gzip;
+  }
+  if (magic == 0xFD2FB528) {
+    return Format::Zstd;
+  }
+  if (magic == 0x184D2204) {
+    return Format::Lz4;
+  }
+  return Format::None;
+}
+
+const char* Decompressor::FormatName(Format format) {
+  switch (format) {
+    case Format::Gzip: return "gzip";
+    case Format::Zstd: return "zstd";
+    case Format::Lz4: return "lz4";
+    default: return "uncompressed";
+  }
+}
+
+std::shared_ptr<const MappedFile> Decompressor::Decompress(
+    const MappedFile& file, Format format, const std::string& path) {
+  std::unique_ptr<Codec> codec = MakeCodec(
+      format, std::unique_ptr<Source>(new MemorySource(file.Data(),
+                                                       file.Size())));
+  CheckSupported(format, codec.get(), path);
+  return Collect(*codec, GetSizeHint(format, file), path);
+}
+
+std::shared_ptr<const MappedFile> Decompressor::ReadStream(
+    int fd, const std::string& path) {
+  StreamCodec codec(fd, false);
+  // Grown as data arrives, the same as for compressed input
+  return Collect(codec, 16 * kBufferSize, path);
+}
+
+std::shared_ptr<InputStream> Decompressor::OpenStream(int fd, bool owned,
+                                                      bool huge_pages) {
+  std::unique_ptr<Codec> codec(new StreamCodec(fd, owned));
+  return std::make_shared<InputStream>(std::move(codec), huge_pages);
+}
+
+std::shared_ptr<InputStream> Decompressor::OpenStream(
+    std::shared_ptr<const MappedFile> file, Format format,
+    const std::string& path, bool huge_pages) {
+  const uint8_t* data = file->Data();
+  size_t size = file->Size();
+  std::unique_ptr<Codec> codec = MakeCodec(
+      format, std::unique_ptr<Source>(new MemorySource(data, size,
+                                                       std::move(file))));
+  CheckSupported(format, codec.get(), path);
+  return std::make_shared<InputStream>(std::move(codec), huge_pages);
+}
+
+std::shared_ptr<InputStream> Decompressor::OpenStream(
+    std::shared_ptr<InputStream> input, Format format,
+    const std::string& path, bool huge_pages) {
+  std::unique_ptr<Codec> codec = MakeCodec(
+      format, std::unique_ptr<Source>(new StreamSource(std::move(input))));
+  CheckSupported(format, codec.get(), path);
+  return std::make_shared<InputStream>(std::move(codec), huge_pages);
+}
@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <cmath>
+
+#include <drift_tracker.h>
+
+
+namespace {
+  // Matches summarised by each point of the fit
+  constexpr size_t kBlockSize = 64;
+  // Points kept for the fit. Older points are dropped, so the fit follows
+  // a skew that changes over time.
+  constexpr size_t kMaxPoints = 32;
+  // Crystal oscillators are within a few hundred ppm. A larger slope can
+  // only come from a few noisy points close together in time.
+  constexpr double kMaxSlope = 1e-3;
+
+  int64_t Median(std::vector<int64_t>& values) {
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+  }
+}
+
+DriftTracker::DriftTracker()
+    : num_matches_(0), reference_(0), intercept_(0.0), slope_(0.0) {
+  block_times_.reserve(kBlockSize);
+  block_deltas_.reserve(kBlockSize);
+}
+
+void DriftTracker::AddMatch(Timestamp time_a, Timestamp time_b) {
+  num_matches_++;
+  block_times_.push_back(time_a.ns);
+  block_deltas_.push_back(time_b.ns - time_a.ns);
+  if (block_times_.size() < kBlockSize) {
+    return;
+  }
+  points_.emplace_back(Median(block_times_), Median(block_deltas_));
+  if (points_.size() > kMaxPoints) {
+    points_.pop_front();
+  }
+  block_times_.clear();
+  block_deltas_.clear();
+  Fit();
+}
+
+void DriftTracker::Fit() {
+  // Least squares over the block medians. Times are taken relative to the
+  // first point to keep the sums well inside double precision.
+  reference_ = points_.front().first;
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  for (const auto& point : points_) {
+    mean_x += point.first - reference_;
+    mean_y += point.second;
+  }
+  mean_x /= points_.size();
+  mean_y /= points_.size();
+  double covariance = 0.0;
+  double variance = 0.0;
+  for (const auto& point : points_) {
+    double x = point.first - reference_ - mean_x;
+    covariance += x * (point.second - mean_y);
+    variance += x * x;
+  }
+  slope_ = variance > 0.0 ? covariance / variance : 0.0;
+  slope_ = std::max(-kMaxSlope, std::min(kMaxSlope, slope_));
+  intercept_ = mean_y - slope_ * mean_x;
+}
+
+Timestamp DriftTracker::Predict(Timestamp time_a) const {
+  return Timestamp::FromNanoseconds(std::llround(
+      intercept_ + slope_ * (time_a.ns - reference_)));
+}
+
+double DriftTracker::GetSkewPpm() const {
+  return slope_ * 1e6;
+}
+
+size_t DriftTracker::NumMatches() const {
+  return num_matches_;
+}
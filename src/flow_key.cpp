@@ -0,0 +1,143 @@
+#include <cstring>
+
+#include <flow_key.h>
+
+
+namespace {
+
+  constexpr uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+
+  // Link layer types (see https://www.tcpdump.org/linktypes.html)
+  constexpr uint32_t kLinkEthernet = 1;
+  constexpr uint32_t kLinkRaw = 101;
+  constexpr uint32_t kLinkLinuxSll = 113;
+  constexpr uint32_t kLinkIpv4 = 228;
+  constexpr uint32_t kLinkIpv6 = 229;
+  constexpr uint32_t kLinkLinuxSll2 = 276;
+
+  constexpr uint16_t kEtherIpv4 = 0x0800;
+  constexpr uint16_t kEtherIpv6 = 0x86DD;
+
+  // Extension headers are only followed this far, so a malformed chain
+  // can't loop for long
+  constexpr int kMaxExtensionHeaders = 8;
+
+  uint16_t Read16(const uint8_t* data) {
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+  }
+
+  uint64_t Mix(uint64_t key, uint64_t value) {
+    key = (key ^ value) * kMultiplier;
+    return key ^ (key >> 29);
+  }
+
+  // length must be a multiple of 8
+  uint64_t MixWords(uint64_t key, const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, data + i, sizeof(word));
+      key = Mix(key, word);
+    }
+    return key;
+  }
+
+  bool HasPorts(uint8_t protocol) {
+    // TCP, UDP, SCTP and UDP-Lite all start with the two ports
+    return protocol == 6 || protocol == 17 || protocol == 132 ||
+           protocol == 136;
+  }
+
+  uint64_t Ports(uint64_t key, uint8_t protocol, const uint8_t* data,
+                 size_t offset, size_t length) {
+    if (HasPorts(protocol) && offset + 4 <= length) {
+      key = Mix(key, Read16(data + offset));
+      key = Mix(key, Read16(data + offset + 2));
+    }
+    return key;
+  }
+
+  uint64_t Ipv4(const uint8_t* data, size_t length) {
+    if (length < 20 || (data[0] >> 4) != 4) return FlowKey::kNone;
+    size_t header_length = (data[0] & 0x0F) * 4;
+    uint8_t protocol = data[9];
+    uint64_t key = Mix(4, protocol);
+    key = MixWords(key, data + 12, 8);
+    // Only the first fragment holds the ports
+    if ((Read16(data + 6) & 0x1FFF) == 0) {
+      key = Ports(key, protocol, data, header_length, length);
+    }
+    return key;
+  }
+
+  uint64_t Ipv6(const uint8_t* data, size_t length) {
+    if (length < 40 || (data[0] >> 4) != 6) return FlowKey::kNone;
+    uint8_t protocol = data[6];
+    size_t offset = 40;
+    bool later_fragment = false;
+    for (int i = 0; i < kMaxExtensionHeaders && offset + 8 <= length; ++i) {
+      if (protocol == 0 || protocol == 43 || protocol == 60) {
+        // Hop-by-hop, routing and destination options
+        uint8_t next = data[offset];
+        offset += (data[offset + 1] + 1) * 8;
+        protocol = next;
+      } else if (protocol == 44) {
+        // Fragment
+        later_fragment = (Read16(data + offset + 2) & 0xFFF8) != 0;
+        protocol = data[offset];
+        offset += 8;
+      } else if (protocol == 51) {
+        // Authentication header
+        uint8_t next = data[offset];
+        offset += (data[offset + 1] + 2) * 4;
+        protocol = next;
+      } else {
+        break;
+      }
+    }
+    uint64_t key = Mix(6, protocol);
+    key = MixWords(key, data + 8, 32);
+    if (!later_fragment) {
+      key = Ports(key, protocol, data, offset, length);
+    }
+    return key;
+  }
+
+  uint64_t Ip(uint16_t ether_type, const uint8_t* data, size_t length) {
+    if (ether_type == kEtherIpv4) return Ipv4(data, length);
+    if (ether_type == kEtherIpv6) return Ipv6(data, length);
+    return FlowKey::kNone;
+  }
+
+}
+
+uint64_t FlowKey::Get(const Packet& packet, uint32_t link_layer) {
+  const uint8_t* data = packet.data;
+  size_t length = packet.Size();
+
+  if (link_layer == kLinkEthernet) {
+    if (length < 14) return kNone;
+    uint16_t ether_type = Read16(data + 12);
+    size_t offset = 14;
+    // 802.1Q, 802.1ad and the older QinQ tag
+    while ((ether_type == 0x8100 || ether_type == 0x88A8 ||
+            ether_type == 0x9100) && offset + 4 <= length) {
+      ether_type = Read16(data + offset + 2);
+      offset += 4;
+    }
+    return Ip(ether_type, data + offset, length - offset);
+  } else if (link_layer == kLinkRaw) {
+    if (length < 1) return kNone;
+    return (data[0] >> 4) == 4 ? Ipv4(data, length) : Ipv6(data, length);
+  } else if (link_layer == kLinkIpv4) {
+    return Ipv4(data, length);
+  } else if (link_layer == kLinkIpv6) {
+    return Ipv6(data, length);
+  } else if (link_layer == kLinkLinuxSll) {
+    if (length < 16) return kNone;
+    return Ip(Read16(data + 14), data + 16, length - 16);
+  } else if (link_layer == kLinkLinuxSll2) {
+    if (length < 20) return kNone;
+    return Ip(Read16(data), data + 20, length - 20);
+  }
+  return kNone;
+}
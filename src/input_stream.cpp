@@ -0,0 +1,222 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include <input_stream.h>
+
+
+namespace {
+
+  constexpr size_t kBlockSize = 8 * 1024 * 1024;
+  // How far the producer reads ahead of the furthest point the parser has
+  // waited for
+  constexpr size_t kReadAhead = 2 * kBlockSize;
+  // Released blocks kept for reuse. Any more are unmapped.
+  constexpr size_t kMaxFreeBlocks = 4;
+
+}
+
+InputStream::InputStream(std::unique_ptr<Producer> producer, bool huge_pages)
+    : producer_(std::move(producer)),
+      huge_pages_(huge_pages),
+      filled_(0),
+      requested_(0),
+      finished_(false),
+      cancelled_(false),
+      view_offset_(0),
+      view_length_(0),
+      view_data_(nullptr),
+      view_filled_(0),
+      thread_(&InputStream::Produce, this) { }
+
+InputStream::~InputStream() {
+  Cancel();
+  thread_.join();
+}
+
+size_t InputStream::WaitFor(size_t end) {
+  if (end <= view_filled_) {
+    return view_filled_;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (end > requested_) {
+    requested_ = end;
+    changed_.notify_all();
+  }
+  changed_.wait(lock, [this, end]() {
+    return filled_ >= end || finished_ || cancelled_;
+  });
+  view_filled_ = filled_;
+  if (filled_ < end && error_) {
+    std::rethrow_exception(error_);
+  }
+  return filled_;
+}
+
+const uint8_t* InputStream::Get(size_t offset, size_t length) {
+  if (offset >= view_offset_ &&
+      offset + length <= view_offset_ + view_length_) {
+    return view_data_ + (offset - view_offset_);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Block& block = FindBlock(offset);
+  size_t start = offset - block.offset;
+  if (start + length <= block.length) {
+    view_offset_ = block.offset;
+    view_length_ = block.length;
+    view_data_ = block.memory->Data();
+    return view_data_ + start;
+  }
+
+  // The record crosses the end of the block. The parser reads the header
+  // of a record before the whole record, so a copy that already covers it
+  // is reused.
+  for (const Carry& carry : carries_) {
+    if (carry.offset == offset && carry.data.size() >= length) {
+      return carry.data.data();
+    }
+  }
+  carries_.push_back(Carry{std::vector<uint8_t>(length), offset});
+  uint8_t* out = carries_.back().data.data();
+  size_t copied = 0;
+  while (copied < length) {
+    const Block& from = FindBlock(offset + copied);
+    size_t from_start = offset + copied - from.offset;
+    size_t count = std::min(length - copied, from.length - from_start);
+    std::memcpy(out + copied, from.memory->Data() + from_start, count);
+    copied += count;
+  }
+  return out;
+}
+
+size_t InputStream::GetPiece(size_t offset, const uint8_t*& data) {
+  if (WaitFor(offset + 1) <= offset) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Block& block = FindBlock(offset);
+  data = block.memory->Data() + (offset - block.offset);
+  return block.offset + block.length - offset;
+}
+
+bool InputStream::FindOffset(const uint8_t* data, size_t& offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const Block& block : blocks_) {
+    const uint8_t* start = block.memory->Data();
+    if (data >= start && data <= start + block.length) {
+      offset = block.offset + (data - start);
+      return true;
+    }
+  }
+  for (const Carry& carry : carries_) {
+    const uint8_t* start = carry.data.data();
+    if (data >= start && data <= start + carry.data.size()) {
+      offset = carry.offset + (data - start);
+      return true;
+    }
+  }
+  return false;
+}
+
+void InputStream::Release(size_t end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // The last block is kept even when full, as the producer may still refer
+  // back to it (e.g. lz4 uses the previous output as its dictionary)
+  while (blocks_.size() > 1 && blocks_.front().offset + kBlockSize <= end) {
+    Block& block = blocks_.front();
+    if (view_data_ == block.memory->Data()) {
+      view_offset_ = 0;
+      view_length_ = 0;
+      view_data_ = nullptr;
+    }
+    if (free_.size() < kMaxFreeBlocks) {
+      free_.push_back(std::move(block.memory));
+    }
+    blocks_.pop_front();
+  }
+  while (!carries_.empty() &&
+         carries_.front().offset + carries_.front().data.size() <= end) {
+    carries_.pop_front();
+  }
+}
+
+void InputStream::Cancel() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    changed_.notify_all();
+  }
+  producer_->Cancel();
+}
+
+void InputStream::Produce() {
+  try {
+    uint8_t* data;
+    while (AcquireBlock(data)) {
+      size_t length = 0;
+      while (length < kBlockSize) {
+        size_t read = producer_->Read(data + length, kBlockSize - length);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (read == 0 || cancelled_) {
+          // An empty last block is not kept
+          if (length == 0) {
+            free_.push_back(std::move(blocks_.back().memory));
+            blocks_.pop_back();
+          }
+          finished_ = true;
+          changed_.notify_all();
+          return;
+        }
+        length += read;
+        blocks_.back().length = length;
+        filled_ += read;
+        changed_.notify_all();
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+    changed_.notify_all();
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    error_ = std::current_exception();
+    finished_ = true;
+    changed_.notify_all();
+  }
+}
+
+bool InputStream::AcquireBlock(uint8_t*& data) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Stay a few blocks ahead of the parser
+  changed_.wait(lock, [this]() {
+    return cancelled_ || filled_ < requested_ ||
+           filled_ - requested_ < kReadAhead;
+  });
+  if (cancelled_) {
+    return false;
+  }
+  std::unique_ptr<MappedFile> memory;
+  if (!free_.empty()) {
+    memory = std::move(free_.back());
+    free_.pop_back();
+  } else {
+    memory.reset(new MappedFile(MappedFile::Anonymous(kBlockSize)));
+    // Must be done before the memory is first written
+    if (huge_pages_) {
+      memory->AdviseHugePages();
+    }
+  }
+  data = memory->DataWritable();
+  blocks_.push_back(Block{std::move(memory), filled_, 0});
+  return true;
+}
+
+const InputStream::Block& InputStream::FindBlock(size_t offset) const {
+  // Every block but the last is full
+  size_t index = blocks_.empty() ? 0 : (offset - blocks_.front().offset) /
+                                       kBlockSize;
+  if (blocks_.empty() || offset < blocks_.front().offset ||
+      index >= blocks_.size()) {
+    throw std::runtime_error("Input data was read after being released.");
+  }
+  return blocks_[index];
+}
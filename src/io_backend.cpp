@@ -0,0 +1,371 @@
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define PCAP_DIFF_URING
+#endif
+#endif
+
+#include <io_backend.h>
+
+
+namespace {
+
+  // Direct I/O needs the buffer, offset and length aligned to the logical
+  // block size. 4 KiB covers all common devices.
+  constexpr size_t kAlignment = 4096;
+  constexpr size_t kReadSize = 1024 * 1024;
+  // io_uring reads kept in flight at once
+  constexpr unsigned kQueueDepth = 32;
+
+  size_t AlignUp(size_t value) {
+    return (value + kAlignment - 1) / kAlignment * kAlignment;
+  }
+
+  std::string ErrorString(const std::string& message, int error) {
+    return message + " " + std::strerror(error);
+  }
+
+  /**
+   * @brief File descriptor that is closed when it goes out of scope
+   */
+  class FileDescriptor {
+    public:
+      explicit FileDescriptor(int fd) : fd_(fd) {}
+      ~FileDescriptor() { if (fd_ != -1) close(fd_); }
+      FileDescriptor(const FileDescriptor&) = delete;
+      FileDescriptor& operator=(const FileDescriptor&) = delete;
+      int Get() const { return fd_; }
+    private:
+      int fd_;
+  };
+
+  // Reads [start, start + size) of the file into data. start must be
+  // aligned for direct I/O.
+  void ReadPread(int fd, uint8_t* data, size_t start, size_t size,
+                 const std::string& path) {
+    size_t offset = 0;
+    while (offset < size) {
+      ssize_t length = pread(fd, data + offset, AlignUp(std::min(kReadSize,
+                             size - offset)), start + offset);
+      if (length == -1 && errno == EINTR) continue;
+      if (length == -1) {
+        throw std::runtime_error(ErrorString("Failed to read file: " + path +
+                                             ".", errno));
+      }
+      if (length == 0) {
+        throw std::runtime_error("Failed to read file: " + path + ". "
+                                 "File was truncated while being read.");
+      }
+      offset += length;
+    }
+  }
+
+#ifdef PCAP_DIFF_URING
+  /**
+   * @brief Minimal io_uring instance for queueing reads
+   * 
+   * Uses the raw system calls, so liburing is not needed.
+   */
+  class Uring {
+    public:
+      explicit Uring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries,
+                                       &params));
+        if (fd_ == -1) {
+          throw std::runtime_error(ErrorString(
+              "io_uring is not available. Use --io-backend=pread.", errno));
+        }
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes +
+                   params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        single_mmap_ = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap_) {
+          sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
+        try {
+          sq_ring_ = Map(sq_size_, IORING_OFF_SQ_RING);
+          cq_ring_ = single_mmap_ ? sq_ring_
+                                  : Map(cq_size_, IORING_OFF_CQ_RING);
+          sqes_ = static_cast<io_uring_sqe*>(Map(sqes_size_,
+                                                 IORING_OFF_SQES));
+        } catch (...) {
+          Cleanup();
+          throw;
+        }
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+      }
+      ~Uring() {
+        Cleanup();
+      }
+      Uring(const Uring&) = delete;
+      Uring& operator=(const Uring&) = delete;
+
+      // Queue a read, which is submitted by the next call to Wait
+      void QueueRead(int fd, uint8_t* data, uint32_t length, uint64_t offset,
+                     uint64_t user_data) {
+        unsigned tail = *sq_tail_;
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe& sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.user_data = user_data;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        to_submit_++;
+      }
+
+      // Submit queued reads and wait for at least one to complete
+      io_uring_cqe Wait() {
+        while (true) {
+          unsigned head = *cq_head_;
+          if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+            return cqe;
+          }
+          long result = syscall(__NR_io_uring_enter, fd_, to_submit_, 1,
+                                IORING_ENTER_GETEVENTS, nullptr, 0);
+          if (result == -1 && errno != EINTR) {
+            throw std::runtime_error(ErrorString("io_uring failed.", errno));
+          }
+          if (result > 0) {
+            to_submit_ -= static_cast<unsigned>(result);
+          }
+        }
+      }
+
+    private:
+      void Cleanup() {
+        if (sqes_ != nullptr) munmap(sqes_, sqes_size_);
+        if (cq_ring_ != nullptr && !single_mmap_) munmap(cq_ring_, cq_size_);
+        if (sq_ring_ != nullptr) munmap(sq_ring_, sq_size_);
+        close(fd_);
+      }
+
+      void* Map(size_t size, off_t offset) {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (data == MAP_FAILED) {
+          throw std::runtime_error(ErrorString("Failed to map io_uring.",
+                                               errno));
+        }
+        return data;
+      }
+
+      int fd_;
+      size_t sq_size_ = 0;
+      size_t cq_size_ = 0;
+      size_t sqes_size_ = 0;
+      bool single_mmap_ = false;
+      void* sq_ring_ = nullptr;
+      void* cq_ring_ = nullptr;
+      io_uring_sqe* sqes_ = nullptr;
+      unsigned* sq_tail_;
+      unsigned sq_mask_;
+      unsigned* sq_array_;
+      unsigned* cq_head_;
+      unsigned* cq_tail_;
+      unsigned cq_mask_;
+      io_uring_cqe* cqes_;
+      unsigned to_submit_ = 0;
+  };
+
+  // The same as ReadPread, through a ring with no reads in flight
+  void ReadUring(Uring& ring, int fd, uint8_t* data, size_t start,
+                 size_t size, const std::string& path) {
+    // Each read is for one chunk of kReadSize bytes. A short read is
+    // requeued for the rest of its chunk.
+    size_t num_chunks = (size + kReadSize - 1) / kReadSize;
+    std::vector<size_t> done(num_chunks, 0);
+    size_t next_chunk = 0;
+    size_t in_flight = 0;
+    auto queue = [&](size_t chunk) {
+      size_t offset = chunk * kReadSize + done[chunk];
+      size_t end = std::min((chunk + 1) * kReadSize, size);
+      ring.QueueRead(fd, data + offset,
+                     static_cast<uint32_t>(AlignUp(end - offset)),
+                     start + offset, chunk);
+      in_flight++;
+    };
+
+    while (next_chunk < num_chunks && in_flight < kQueueDepth) {
+      queue(next_chunk++);
+    }
+    while (in_flight > 0) {
+      io_uring_cqe cqe = ring.Wait();
+      in_flight--;
+      size_t chunk = cqe.user_data;
+      if (cqe.res < 0) {
+        throw std::runtime_error(ErrorString("Failed to read file: " + path +
+                                             ".", -cqe.res));
+      }
+      if (cqe.res == 0) {
+        throw std::runtime_error("Failed to read file: " + path + ". "
+                                 "File was truncated while being read.");
+      }
+      done[chunk] += cqe.res;
+      if (chunk * kReadSize + done[chunk] <
+          std::min((chunk + 1) * kReadSize, size)) {
+        queue(chunk);
+      } else if (next_chunk < num_chunks) {
+        queue(next_chunk++);
+      }
+    }
+  }
+#endif
+
+  // Opens a file for the pread and uring backends
+  int OpenInput(const std::string& path, const IoBackend::Options& options) {
+    int flags = O_RDONLY;
+    if (options.direct) {
+      flags |= O_DIRECT;
+    }
+    int fd = open(path.c_str(), flags);
+    if (fd == -1) {
+      throw std::runtime_error(ErrorString("Failed to open file: " + path +
+                                           ".", errno));
+    }
+    return fd;
+  }
+
+  size_t GetInputSize(int fd, const std::string& path) {
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+      throw std::runtime_error("Failed to get file size of file: " + path);
+    }
+    if (sb.st_size == 0) {
+      throw std::runtime_error("Failed to parse file: " + path + "\n"
+                               "File is too small to be a PCAP file.");
+    }
+    return sb.st_size;
+  }
+
+  /**
+   * @brief Reads a file from start to end into the blocks of an InputStream
+   *
+   * The blocks are page aligned and every read but the last one ends on a
+   * block boundary, so reads stay aligned for direct I/O.
+   */
+  class FileProducer : public InputStream::Producer {
+    public:
+      FileProducer(const std::string& path, const IoBackend::Options& options)
+          : path_(path), fd_(OpenInput(path, options)),
+            size_(GetInputSize(fd_.Get(), path)), offset_(0) {
+#ifdef PCAP_DIFF_URING
+        if (options.type == IoBackend::Type::Uring) {
+          ring_.reset(new Uring(kQueueDepth));
+        }
+#else
+        if (options.type == IoBackend::Type::Uring) {
+          throw std::runtime_error("io_uring is not supported on this "
+                                   "system. Use --io-backend=pread.");
+        }
+#endif
+      }
+      size_t Read(uint8_t* out, size_t capacity) override {
+        size_t length = std::min(capacity, size_ - offset_);
+        if (length == 0) {
+          return 0;
+        }
+#ifdef PCAP_DIFF_URING
+        if (ring_) {
+          ReadUring(*ring_, fd_.Get(), out, offset_, length, path_);
+        } else {
+          ReadPread(fd_.Get(), out, offset_, length, path_);
+        }
+#else
+        ReadPread(fd_.Get(), out, offset_, length, path_);
+#endif
+        offset_ += length;
+        return length;
+      }
+    private:
+      std::string path_;
+      FileDescriptor fd_;
+      size_t size_;
+      size_t offset_;
+#ifdef PCAP_DIFF_URING
+      std::unique_ptr<Uring> ring_;
+#endif
+  };
+
+}
+
+IoBackend::Type IoBackend::Parse(const std::string& name) {
+  if (name == "mmap") return Type::Mmap;
+  if (name == "pread") return Type::Pread;
+  if (name == "uring") return Type::Uring;
+  throw std::runtime_error("Invalid I/O backend: " + name);
+}
+
+std::shared_ptr<const MappedFile> IoBackend::Read(const std::string& path,
+                                                  const Options& options) {
+  if (options.type == Type::Mmap) {
+    auto file = std::make_shared<const MappedFile>(path, false, 0,
+                                                   options.populate);
+    if (options.huge_pages) {
+      file->AdviseHugePages();
+    }
+    return file;
+  }
+
+  FileDescriptor fd(OpenInput(path, options));
+  size_t size = GetInputSize(fd.Get(), path);
+
+  // Anonymous memory is page aligned. Reads are rounded up to whole
+  // blocks, so the last one may need space past the end of the file.
+  auto file = std::make_shared<MappedFile>(
+      MappedFile::Anonymous(AlignUp(size)));
+  // Must be done before the memory is first written
+  if (options.huge_pages) {
+    file->AdviseHugePages();
+  }
+  if (options.type == Type::Uring) {
+#ifdef PCAP_DIFF_URING
+    Uring ring(kQueueDepth);
+    ReadUring(ring, fd.Get(), file->DataWritable(), 0, size, path);
+#else
+    throw std::runtime_error("io_uring is not supported on this system. "
+                             "Use --io-backend=pread.");
+#endif
+  } else {
+    ReadPread(fd.Get(), file->DataWritable(), 0, size, path);
+  }
+  file->Resize(size);
+  return file;
+}
+
+std::shared_ptr<InputStream> IoBackend::Stream(const std::string& path,
+                                               const Options& options) {
+  std::unique_ptr<InputStream::Producer> producer(
+      new FileProducer(path, options));
+  return std::make_shared<InputStream>(std::move(producer),
+                                       options.huge_pages);
+}
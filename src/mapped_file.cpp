@@ -4,11 +4,22 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <algorithm>
 
 #include <mapped_file.h>
 
 
-MappedFile::MappedFile(const std::string& path, bool writable, size_t size) :
+namespace {
+
+  size_t PageSize() {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+  }
+
+}
+
+MappedFile::MappedFile(const std::string& path, bool writable, size_t size,
+                       bool populate) :
     writable_(writable) {
 
   if (writable) {
@@ -39,12 +50,13 @@ MappedFile::MappedFile(const std::string& path, bool writable, size_t size) :
     size_ = sb.st_size;
   }
 
+  int flags = populate ? MAP_POPULATE : 0;
   if (writable) {
-    data_ = static_cast<uint8_t*>(
-        mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+    data_ = static_cast<uint8_t*>(mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | flags, fd_, 0));
   } else {
-    data_ = static_cast<uint8_t*>(
-        mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0));
+    data_ = static_cast<uint8_t*>(mmap(nullptr, size_, PROT_READ,
+                                       MAP_PRIVATE | flags, fd_, 0));
   }
   if (data_ == MAP_FAILED) {
     close(fd_);
@@ -56,7 +68,8 @@ MappedFile::MappedFile(const std::string& path, bool writable, size_t size) :
 MappedFile::MappedFile(MappedFile&& other) noexcept 
     : fd_(other.fd_),
       data_(other.data_),
-      size_(other.size_) {
+      size_(other.size_),
+      writable_(other.writable_) {
   other.fd_ = -1;
   other.data_ = nullptr;
   other.size_ = 0;
@@ -69,6 +82,7 @@ MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
     fd_ = other.fd_;
     data_ = other.data_;
     size_ = other.size_;
+    writable_ = other.writable_;
     other.fd_ = -1;
     other.data_ = nullptr;
     other.size_ = 0;
@@ -76,6 +90,87 @@ MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
   return *this;
 }
 
+MappedFile MappedFile::Anonymous(size_t size) {
+  MappedFile memory;
+  memory.data_ = static_cast<uint8_t*>(
+      mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  if (memory.data_ == MAP_FAILED) {
+    memory.data_ = nullptr;
+    throw std::runtime_error("Failed to map " + std::to_string(size) +
+                             " bytes of memory. " + std::strerror(errno));
+  }
+  memory.size_ = size;
+  return memory;
+}
+
+void MappedFile::Resize(size_t size) {
+  if (fd_ != -1) {
+    throw std::runtime_error("Only anonymous memory can be resized.");
+  }
+  void* data = mremap(data_, size_, size, MREMAP_MAYMOVE);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Failed to map " + std::to_string(size) +
+                             " bytes of memory. " + std::strerror(errno));
+  }
+  data_ = static_cast<uint8_t*>(data);
+  size_ = size;
+}
+
+void MappedFile::Advise(Access access) const {
+  if (data_ == nullptr) {
+    return;
+  }
+  int advice = MADV_NORMAL;
+  if (access == Access::Sequential) {
+    advice = MADV_SEQUENTIAL;
+  } else if (access == Access::Random) {
+    advice = MADV_RANDOM;
+  }
+  madvise(data_, size_, advice);
+}
+
+void MappedFile::AdviseHugePages() const {
+#ifdef MADV_HUGEPAGE
+  if (data_ != nullptr) {
+    madvise(data_, size_, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+void MappedFile::Prefetch(size_t offset, size_t length) const {
+  if (data_ == nullptr || offset >= size_) {
+    return;
+  }
+  // madvise needs a page aligned address, so start at the page containing
+  // the offset
+  size_t end = std::min(size_, offset + length);
+  offset -= offset % PageSize();
+  madvise(data_ + offset, end - offset, MADV_WILLNEED);
+}
+
+size_t MappedFile::Release(size_t offset, size_t length) const {
+  if (data_ == nullptr || offset >= size_) {
+    return offset;
+  }
+  // Only whole pages inside the range are released, as the rest of a
+  // partly covered page may still be needed. The last page of the mapping
+  // is whole even if the file ends part way through it.
+  size_t end = std::min(size_, offset + length);
+  size_t start = (offset + PageSize() - 1) / PageSize() * PageSize();
+  if (end != size_) {
+    end -= end % PageSize();
+  }
+  if (end <= start) {
+    return offset;
+  }
+  madvise(data_ + start, end - start, MADV_DONTNEED);
+  if (fd_ != -1 && !writable_) {
+    posix_fadvise(fd_, start, end - start, POSIX_FADV_DONTNEED);
+  }
+  return end;
+}
+
 MappedFile::~MappedFile() {
     Cleanup();
 }
@@ -0,0 +1,165 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PCAP_DIFF_X86
+#endif
+
+#include <masked_compare.h>
+
+
+MaskedCompare::ByteMask::ByteMask(const std::vector<bool>& mask) {
+  // Bytes after the last ignored byte are compared anyway
+  size_t length = mask.size();
+  while (length > 0 && mask[length - 1]) {
+    length--;
+  }
+  if (length == 0) {
+    return;
+  }
+
+  size_t padded = (length + kAlignment - 1) / kAlignment * kAlignment;
+  void* data = nullptr;
+  if (posix_memalign(&data, kAlignment, padded) != 0) {
+    throw std::bad_alloc();
+  }
+  data_ = static_cast<uint8_t*>(data);
+  size_ = length;
+  std::memset(data_, 0, padded);
+  for (size_t i = 0; i < length; ++i) {
+    data_[i] = mask[i] ? 0xFF : 0x00;
+  }
+}
+
+MaskedCompare::ByteMask::~ByteMask() {
+  std::free(data_);
+}
+
+MaskedCompare::ByteMask::ByteMask(ByteMask&& other) noexcept
+    : data_(other.data_),
+      size_(other.size_) {
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+MaskedCompare::ByteMask& MaskedCompare::ByteMask::operator=(
+    ByteMask&& other) noexcept {
+  if (this != &other) {
+    std::free(data_);
+    data_ = other.data_;
+    size_ = other.size_;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+const uint8_t* MaskedCompare::ByteMask::Data() const { return data_; }
+
+size_t MaskedCompare::ByteMask::Size() const { return size_; }
+
+namespace {
+
+  bool CompareScalar(const uint8_t* a, const uint8_t* b,
+                     const uint8_t* mask, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+      if ((a[i] ^ b[i]) & mask[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+#ifdef PCAP_DIFF_X86
+  // The mask is 64 byte aligned and padded, so it can always be read with
+  // aligned loads. Packet data has no alignment guarantees.
+
+  __attribute__((target("sse2")))
+  bool CompareSse2(const uint8_t* a, const uint8_t* b,
+                   const uint8_t* mask, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+      __m128i diff = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+      diff = _mm_and_si128(
+          diff, _mm_load_si128(reinterpret_cast<const __m128i*>(mask + i)));
+      if (_mm_movemask_epi8(
+              _mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+        return false;
+      }
+    }
+    return CompareScalar(a + i, b + i, mask + i, length - i);
+  }
+
+  __attribute__((target("avx2")))
+  bool CompareAvx2(const uint8_t* a, const uint8_t* b,
+                   const uint8_t* mask, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+      __m256i diff = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+      if (!_mm256_testz_si256(
+              diff,
+              _mm256_load_si256(reinterpret_cast<const __m256i*>(mask + i)))) {
+        return false;
+      }
+    }
+    return CompareSse2(a + i, b + i, mask + i, length - i);
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  bool CompareAvx512(const uint8_t* a, const uint8_t* b,
+                     const uint8_t* mask, size_t length) {
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+      __m512i diff = _mm512_xor_si512(_mm512_loadu_si512(a + i),
+                                      _mm512_loadu_si512(b + i));
+      if (_mm512_test_epi8_mask(diff, _mm512_load_si512(mask + i)) != 0) {
+        return false;
+      }
+    }
+    if (i < length) {
+      // Masked loads never touch the bytes after the end of the packets
+      __mmask64 tail = (~0ULL) >> (64 - (length - i));
+      __m512i diff = _mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, a + i),
+                                      _mm512_maskz_loadu_epi8(tail, b + i));
+      if (_mm512_test_epi8_mask(diff, _mm512_load_si512(mask + i)) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+#endif
+
+}
+
+MaskedCompare::Function MaskedCompare::Select() {
+#ifdef PCAP_DIFF_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    return CompareAvx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return CompareAvx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return CompareSse2;
+  }
+#endif
+  return CompareScalar;
+}
+
+const char* MaskedCompare::SelectedName() {
+  Function function = Select();
+#ifdef PCAP_DIFF_X86
+  if (function == CompareAvx512) return "AVX-512";
+  if (function == CompareAvx2) return "AVX2";
+  if (function == CompareSse2) return "SSE2";
+#endif
+  (void)function;
+  return "Scalar";
+}
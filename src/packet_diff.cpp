@@ -2,20 +2,282 @@
 #include <algorithm>
 #include <regex>
 #include <iostream>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
 
 #include <packet_diff.h>
+#include <flow_key.h>
+
+
+namespace {
+
+  /**
+   * @brief Packet indexes grouped by hash, for the full search method
+   *
+   * Every bucket is a slice of one shared array, in hash then packet order,
+   * and buckets are found through a single open addressing table. Tens of
+   * millions of distinct packets then take two allocations rather than a
+   * node and a vector each, which is also much quicker to free.
+   */
+  class HashBuckets {
+    public:
+      struct Bucket {
+        uint64_t hash;
+        uint32_t begin;
+        // 0 for an empty slot, as a used bucket always has end > begin
+        uint32_t end;
+        // All packets before this index in the bucket are already matched
+        uint32_t first_unmatched;
+      };
+
+      // Indexes the packets for which include(index) is true. Packets must
+      // have their hashes.
+      template <typename Include>
+      HashBuckets(const Packets& packets, const Include& include) {
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        entries.reserve(packets.Size());
+        for (size_t i = 0; i < packets.Size(); ++i) {
+          if (include(i)) {
+            entries.emplace_back(packets.GetHash(i), i);
+          }
+        }
+        std::sort(entries.begin(), entries.end());
+        packets_.resize(entries.size());
+        size_t num_buckets = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+          packets_[i] = entries[i].second;
+          if (i == 0 || entries[i].first != entries[i - 1].first) {
+            num_buckets++;
+          }
+        }
+        // At most half full, so probe sequences stay short
+        shift_ = 64;
+        while ((size_t(1) << (64 - shift_)) < num_buckets * 2) {
+          shift_--;
+        }
+        table_.assign(size_t(1) << (64 - shift_), Bucket{0, 0, 0, 0});
+        for (size_t begin = 0, end; begin < entries.size(); begin = end) {
+          end = begin + 1;
+          while (end < entries.size() &&
+                 entries[end].first == entries[begin].first) {
+            end++;
+          }
+          table_[Slot(entries[begin].first)] = Bucket{
+              entries[begin].first, static_cast<uint32_t>(begin),
+              static_cast<uint32_t>(end), static_cast<uint32_t>(begin)};
+        }
+      }
+
+      // Returns nullptr if no packet has the hash
+      Bucket* Find(uint64_t hash) {
+        Bucket* bucket = &table_[Slot(hash)];
+        return bucket->end == 0 ? nullptr : bucket;
+      }
+
+      uint32_t Candidate(size_t index) const { return packets_[index]; }
+
+      // Calls visit(index) for each packet with the hash whose index is in
+      // [begin, end), in order, until visit returns true. Safe to call from
+      // several threads.
+      template <typename Visit>
+      void ForEach(uint64_t hash, size_t begin, size_t end,
+                   const Visit& visit) const {
+        const Bucket& bucket = table_[Slot(hash)];
+        if (bucket.end == 0) return;
+        const uint32_t* last = packets_.data() + bucket.end;
+        for (const uint32_t* it = std::lower_bound(
+                 packets_.data() + bucket.begin, last, begin);
+             it != last && *it < end; ++it) {
+          if (visit(*it)) return;
+        }
+      }
+
+    private:
+      // Slot holding the hash, or the empty slot where it would go
+      size_t Slot(uint64_t hash) const {
+        const uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+        size_t mask = table_.size() - 1;
+        size_t slot = shift_ == 64 ? 0 : (hash * kMultiplier) >> shift_;
+        while (table_[slot].end != 0 && table_[slot].hash != hash) {
+          slot = (slot + 1) & mask;
+        }
+        return slot;
+      }
+
+      std::vector<uint32_t> packets_;
+      std::vector<Bucket> table_;
+      unsigned shift_;
+  };
+
+  /**
+   * @brief Linear space Myers diff of two sequences
+   *
+   * Finds a longest common subsequence of [0, size_a) and [0, size_b) under
+   * equal(a, b), and calls match(a, b) for each pair in it. Uses the divide
+   * and conquer form of the O((N+M)D) algorithm, so only O(N+M) memory is
+   * needed. A subproblem with an edit distance above kMaxCost is split at
+   * the furthest point reached instead, which keeps very different inputs
+   * near linear at the cost of a longer than minimal edit script there.
+   */
+  template <typename Equal, typename Match>
+  void AlignSequences(size_t size_a, size_t size_b, const Equal& equal,
+                      const Match& match) {
+    const int64_t kMaxCost = 1024;
+    struct Range {
+      size_t begin_a, end_a, begin_b, end_b;
+    };
+    std::vector<Range> ranges{Range{0, size_a, 0, size_b}};
+    std::vector<int64_t> forward;
+    std::vector<int64_t> reverse;
+
+    while (!ranges.empty()) {
+      Range range = ranges.back();
+      ranges.pop_back();
+      // A common prefix and suffix are always part of the alignment
+      while (range.begin_a < range.end_a && range.begin_b < range.end_b &&
+             equal(range.begin_a, range.begin_b)) {
+        match(range.begin_a++, range.begin_b++);
+      }
+      while (range.begin_a < range.end_a && range.begin_b < range.end_b &&
+             equal(range.end_a - 1, range.end_b - 1)) {
+        match(--range.end_a, --range.end_b);
+      }
+      if (range.begin_a == range.end_a || range.begin_b == range.end_b) {
+        continue;
+      }
+
+      // Search for the middle snake from both ends at once. forward holds
+      // the furthest x reached on each diagonal k = x - y from the start,
+      // and reverse the same measured back from the end.
+      const int64_t n = range.end_a - range.begin_a;
+      const int64_t m = range.end_b - range.begin_b;
+      const int64_t delta = n - m;
+      const bool odd = delta % 2 != 0;
+      const int64_t max_d = std::min((n + m + 1) / 2, kMaxCost);
+      const int64_t offset = max_d + 1;
+      forward.assign(2 * offset + 1, -1);
+      reverse.assign(2 * offset + 1, -1);
+      forward[offset + 1] = 0;
+      reverse[offset + 1] = 0;
+      auto equal_forward = [&](int64_t x, int64_t y) {
+        return equal(range.begin_a + x, range.begin_b + y);
+      };
+      auto equal_reverse = [&](int64_t x, int64_t y) {
+        return equal(range.end_a - x - 1, range.end_b - y - 1);
+      };
+
+      int64_t split_x = -1;
+      int64_t split_y = -1;
+      int64_t best_x = 0;
+      int64_t best_y = 0;
+      // Diagonals that have left the edit graph are not searched again
+      int64_t k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+      for (int64_t d = 0; d < max_d && split_x == -1; ++d) {
+        for (int64_t k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+          int64_t k1_offset = offset + k1;
+          int64_t x1;
+          if (k1 == -d || (k1 != d && forward[k1_offset - 1] <
+                                      forward[k1_offset + 1])) {
+            x1 = forward[k1_offset + 1];
+          } else {
+            x1 = forward[k1_offset - 1] + 1;
+          }
+          int64_t y1 = x1 - k1;
+          while (x1 < n && y1 < m && equal_forward(x1, y1)) {
+            x1++;
+            y1++;
+          }
+          forward[k1_offset] = x1;
+          if (x1 > n) {
+            k1_end += 2;
+          } else if (y1 > m) {
+            k1_start += 2;
+          } else {
+            if (x1 + y1 > best_x + best_y) {
+              best_x = x1;
+              best_y = y1;
+            }
+            int64_t k2_offset = offset + delta - k1;
+            if (odd && k2_offset >= 0 &&
+                k2_offset < static_cast<int64_t>(reverse.size()) &&
+                reverse[k2_offset] != -1 && x1 >= n - reverse[k2_offset]) {
+              split_x = x1;
+              split_y = y1;
+              break;
+            }
+          }
+        }
+        if (split_x != -1) break;
+
+        for (int64_t k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+          int64_t k2_offset = offset + k2;
+          int64_t x2;
+          if (k2 == -d || (k2 != d && reverse[k2_offset - 1] <
+                                      reverse[k2_offset + 1])) {
+            x2 = reverse[k2_offset + 1];
+          } else {
+            x2 = reverse[k2_offset - 1] + 1;
+          }
+          int64_t y2 = x2 - k2;
+          while (x2 < n && y2 < m && equal_reverse(x2, y2)) {
+            x2++;
+            y2++;
+          }
+          reverse[k2_offset] = x2;
+          if (x2 > n) {
+            k2_end += 2;
+          } else if (y2 > m) {
+            k2_start += 2;
+          } else if (!odd) {
+            int64_t k1_offset = offset + delta - k2;
+            if (k1_offset >= 0 &&
+                k1_offset < static_cast<int64_t>(forward.size()) &&
+                forward[k1_offset] != -1) {
+              int64_t x1 = forward[k1_offset];
+              if (x1 >= n - x2) {
+                split_x = x1;
+                split_y = x1 - (k1_offset - offset);
+                break;
+              }
+            }
+          }
+        }
+      }
+      if (split_x == -1) {
+        if (max_d < kMaxCost || best_x + best_y == 0) {
+          // The two ranges have nothing in common
+          continue;
+        }
+        // Too expensive to find the middle snake
+        split_x = best_x;
+        split_y = best_y;
+      }
+      ranges.push_back(Range{range.begin_a + split_x, range.end_a,
+                             range.begin_b + split_y, range.end_b});
+      ranges.push_back(Range{range.begin_a, range.begin_a + split_x,
+                             range.begin_b, range.begin_b + split_y});
+    }
+  }
 
+}
 
 PacketDiff::PacketDiff(const std::string& search_mode,
                        const std::string& mask,
                        const std::string& range_a,
                        const std::string& range_b,
-                       const std::pair<Timestamp, Timestamp>& time_range)
+                       const std::pair<Timestamp, Timestamp>& time_range,
+                       size_t num_threads)
     : search_method_(ParseSearchMethod(search_mode)),
       mask_(MaskStringToVector(mask)),
+      masked_compare_(MaskedCompare::Select()),
+      content_hash_(ContentHash::Select()),
       range_a_(RangeStringToPair(range_a)),
       range_b_(RangeStringToPair(range_b)),
-      time_range_(time_range) {
+      time_range_(time_range),
+      thread_pool_(num_threads),
+      track_drift_(false),
+      match_by_flow_(false) {
 
   if (range_a_.second > 0 && range_b_.second > 0) {
     if (static_cast<size_t>(range_a_.second) <= range_a_.first) {
@@ -83,126 +345,630 @@ PacketDiff::SearchMethod PacketDiff::ParseSearchMethod(
     return PacketDiff::SearchMethod::Full;
   } else if (search_method == "location") {
     return PacketDiff::SearchMethod::Location;
+  } else if (search_method == "sequence") {
+    return PacketDiff::SearchMethod::Sequence;
   } else {
     throw std::runtime_error("Invalid search method:" + search_method);
   }
 }
 
 void PacketDiff::FindMatching(Packets& packets_a, Packets& packets_b) {
-  if (search_method_ == SearchMethod::Timestamp) {
-    FindMatchingTimestampSearch(packets_a, packets_b);
+  // Searches compare the packet hashes before the packet data. The
+  // location search compares each packet only once, so hashing would
+  // just read every packet twice.
+  if (search_method_ != SearchMethod::Location) {
+    HashPackets(packets_a, range_a_);
+    HashPackets(packets_b, range_b_);
+  }
+  if (match_by_flow_) {
+    FindMatchingByFlow(packets_a, packets_b);
+  } else if (search_method_ == SearchMethod::Timestamp) {
+    if (thread_pool_.Size() > 1 && !track_drift_) {
+      FindMatchingTimestampSearchParallel(packets_a, packets_b);
+    } else {
+      FindMatchingTimestampSearch(packets_a, packets_b);
+    }
   } else if (search_method_ == SearchMethod::Full) {
     FindMatchingFullSearch(packets_a, packets_b);
-  } else { // search_method_ == SearchMethod::Location
+  } else if (search_method_ == SearchMethod::Location) {
     FindMatchingLocationSearch(packets_a, packets_b);
+  } else { // search_method_ == SearchMethod::Sequence
+    FindMatchingSequenceSearch(packets_a, packets_b);
   }
 }
 
+const std::pair<Timestamp, Timestamp>& PacketDiff::GetTimeRange() const {
+  return time_range_;
+}
+
+void PacketDiff::SetTrackDrift(bool track_drift) {
+  track_drift_ = track_drift;
+}
+
+bool PacketDiff::IsTrackingDrift() const {
+  return track_drift_;
+}
+
+const DriftTracker& PacketDiff::GetDriftTracker() const {
+  return drift_tracker_;
+}
+
+void PacketDiff::SetMatchByFlow(bool match_by_flow) {
+  match_by_flow_ = match_by_flow;
+}
+
+bool PacketDiff::UseWindowIndex(const Packets& packets_b) const {
+  // Scanning a window is cheap while most of it is already matched, so
+  // hashing every packet only pays off when the windows hold many packets.
+  // The end of each window is then found by bisection, which is only the
+  // same as the linear scan if B is in time order.
+  const double kMinWindowPackets = 512;
+  const std::vector<Timestamp>& times_b = packets_b.GetTimes();
+  if (times_b.size() < 2 ||
+      !std::is_sorted(times_b.begin(), times_b.end())) {
+    return false;
+  }
+  double span = (times_b.back() - times_b.front()).ns;
+  double width = (time_range_.first + time_range_.second).ns;
+  if (span > 0 && times_b.size() * width / span < kMinWindowPackets) {
+    return false;
+  }
+  return true;
+}
+
 void PacketDiff::FindMatchingTimestampSearch(Packets& packets_a,
                                              Packets& packets_b) {
 
-  auto it_b_start = packets_b.begin();
+  const std::vector<Timestamp>& times_a = packets_a.GetTimes();
+  const std::vector<Timestamp>& times_b = packets_b.GetTimes();
+  auto it_b_start = times_b.begin();
+  // Packets in B indexed by hash, so that only packets with the same
+  // contents are compared
+  std::unique_ptr<HashBuckets> buckets_b;
+  if (UseWindowIndex(packets_b)) {
+    size_t start, end;
+    buckets_b.reset(new HashBuckets(packets_b, [&](size_t i) {
+      return SelectRange(packets_b[i], range_b_, start, end);
+    }));
+  }
 
-  for (auto& packet_a : packets_a) {
+  for (size_t index_a = 0; index_a < packets_a.Size(); ++index_a) {
 
-    if (packet_a.match) continue;
+    if (packets_a.IsMatched(index_a)) continue;
 
-    Timestamp window_start = packet_a.header.time - time_range_.first;
-    Timestamp window_end = packet_a.header.time + time_range_.second;
+    Timestamp window_start = times_a[index_a] - time_range_.first;
+    Timestamp window_end = times_a[index_a] + time_range_.second;
+    if (track_drift_) {
+      Timestamp drift = drift_tracker_.Predict(times_a[index_a]);
+      window_start += drift;
+      window_end += drift;
+      // The drift estimate can move the window back slightly
+      if (it_b_start != times_b.begin() && window_start <= *(it_b_start - 1)) {
+        it_b_start = std::lower_bound(times_b.begin(), it_b_start,
+                                      window_start);
+      }
+    }
 
     // Move it_b_start to the first element in B within the time window.
     // PCAPs are in time order, so we can start the search at the
     // packet at the start of the last window
-    it_b_start = std::lower_bound(it_b_start, packets_b.end(), window_start,
-        [](const Packet& b, const Timestamp& start) {
-            return b.header.time < start;
-        });
+    it_b_start = std::lower_bound(it_b_start, times_b.end(), window_start);
 
     // Check for matching entries within the time window
-    for (auto it_b = it_b_start; it_b != packets_b.end() &&
-         it_b->header.time <= window_end; ++it_b) {
-
-      if (!it_b->match && ComparePacket(packet_a, *it_b)) {
-        packet_a.match = true;
-        packet_a.match_packet = &(*it_b);
-        it_b->match = true;
-        it_b->match_packet = &packet_a;
+    auto visit = [&](size_t index_b) {
+      if (!packets_b.IsMatched(index_b) &&
+          ComparePacket(packets_a, index_a, packets_b, index_b)) {
+        SetMatch(packets_a, index_a, packets_b, index_b);
+        if (track_drift_) {
+          drift_tracker_.AddMatch(times_a[index_a], times_b[index_b]);
+        }
+        return true;
+      }
+      return false;
+    };
+    size_t begin_b = it_b_start - times_b.begin();
+    if (buckets_b) {
+      size_t end_b = std::upper_bound(it_b_start, times_b.end(),
+                                      window_end) - times_b.begin();
+      buckets_b->ForEach(packets_a.GetHash(index_a), begin_b, end_b, visit);
+    } else {
+      for (size_t index_b = begin_b;
+           index_b < times_b.size() && times_b[index_b] <= window_end;
+           ++index_b) {
+        if (visit(index_b)) break;
+      }
+    }
+  }
+}
+
+void PacketDiff::FindMatchingTimestampSearchParallel(Packets& packets_a,
+                                                     Packets& packets_b) {
+  // Produces exactly the same matches as FindMatchingTimestampSearch.
+  // File A is split into time slices that are searched in parallel. Each
+  // slice only reads the packets in B within the time window of its own
+  // packets (the slice plus a halo of the window size at either end). The
+  // slices can't know which packets in B the other slices will match, so
+  // they find the first few matching candidates for each packet. The
+  // candidates are then reconciled in file order, with the same first
+  // unmatched packet wins rule as the serial search.
+  const size_t kMaxCandidates = 4;
+  const std::vector<Timestamp>& times_a = packets_a.GetTimes();
+  const std::vector<Timestamp>& times_b = packets_b.GetTimes();
+  size_t num_a = packets_a.Size();
+
+  // Start of the time window in B for each packet in A. Uses the same
+  // search as the serial version so results match even if the files are
+  // not quite in time order.
+  std::vector<size_t> window_start(num_a, 0);
+  auto it_b_start = times_b.begin();
+  for (size_t i = 0; i < num_a; ++i) {
+    if (packets_a.IsMatched(i)) continue;
+    it_b_start = std::lower_bound(it_b_start, times_b.end(),
+                                  times_a[i] - time_range_.first);
+    window_start[i] = it_b_start - times_b.begin();
+  }
+
+  // If a packet has more candidates than kMaxCandidates, num_candidates is
+  // set to kMaxCandidates + 1.
+  std::vector<uint32_t> candidates(num_a * kMaxCandidates);
+  std::vector<uint8_t> num_candidates(num_a, 0);
+  // Packets in B indexed by hash, so that only packets with the same
+  // contents are compared
+  std::unique_ptr<HashBuckets> buckets_b;
+  if (UseWindowIndex(packets_b)) {
+    size_t start, end;
+    buckets_b.reset(new HashBuckets(packets_b, [&](size_t i) {
+      return SelectRange(packets_b[i], range_b_, start, end);
+    }));
+  }
+  // Calls visit for the packets in B from begin_b to the end of the time
+  // window of packet i in A, until it returns true
+  auto search = [&](size_t i, size_t begin_b,
+                    const std::function<bool(size_t)>& visit) {
+    Timestamp window_end = times_a[i] + time_range_.second;
+    if (buckets_b) {
+      size_t end_b = std::upper_bound(times_b.begin() + begin_b,
+                                      times_b.end(), window_end) -
+                     times_b.begin();
+      buckets_b->ForEach(packets_a.GetHash(i), begin_b, end_b, visit);
+    } else {
+      for (size_t index_b = begin_b; index_b < times_b.size() &&
+           times_b[index_b] <= window_end; ++index_b) {
+        if (visit(index_b)) break;
+      }
+    }
+  };
+  thread_pool_.ParallelFor(num_a, 256, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (packets_a.IsMatched(i)) continue;
+      size_t count = 0;
+      search(i, window_start[i], [&](size_t index_b) {
+        if (!ComparePacket(packets_a, i, packets_b, index_b)) {
+          return false;
+        }
+        if (count == kMaxCandidates) {
+          count++;
+          return true;
+        }
+        candidates[i * kMaxCandidates + count] = index_b;
+        count++;
+        return false;
+      });
+      num_candidates[i] = count;
+    }
+  });
+
+  // Reconcile the slices in file order
+  for (size_t i = 0; i < num_a; ++i) {
+    if (packets_a.IsMatched(i) || num_candidates[i] == 0) continue;
+
+    size_t match = Packets::kNoMatch;
+    size_t count = std::min<size_t>(num_candidates[i], kMaxCandidates);
+    for (size_t c = 0; c < count; ++c) {
+      uint32_t candidate = candidates[i * kMaxCandidates + c];
+      if (!packets_b.IsMatched(candidate)) {
+        match = candidate;
         break;
       }
     }
+    // All stored candidates were taken by earlier packets, so carry on
+    // searching the window after the last one
+    if (match == Packets::kNoMatch && num_candidates[i] > kMaxCandidates) {
+      search(i, candidates[i * kMaxCandidates + count - 1] + 1,
+             [&](size_t index_b) {
+        if (!packets_b.IsMatched(index_b) &&
+            ComparePacket(packets_a, i, packets_b, index_b)) {
+          match = index_b;
+          return true;
+        }
+        return false;
+      });
+    }
+
+    if (match != Packets::kNoMatch) {
+      SetMatch(packets_a, i, packets_b, match);
+    }
   }
 }
 
 void PacketDiff::FindMatchingFullSearch(Packets& packets_a,
                                         Packets& packets_b) {
-  for (auto& packet_a : packets_a) {
-    for (auto& packet_b : packets_b) {
-      if (packet_b.match) continue;
-      if (ComparePacket(packet_a, packet_b)) {
-        packet_a.match = true;
-        packet_a.match_packet = &packet_b;
-        packet_b.match = true;
-        packet_b.match_packet = &packet_a;
+  // Index packets in B by a hash of the bytes that are compared, keeping
+  // each bucket in file order. Packets that can't match anything are not
+  // indexed.
+  size_t start, end;
+  HashBuckets index_b(packets_b, [&](size_t i) {
+    return !packets_b.IsMatched(i) &&
+           SelectRange(packets_b[i], range_b_, start, end);
+  });
+
+  // Each packet in A matches the first unmatched packet in B with the same
+  // contents, which is the same result as comparing against every packet
+  for (size_t index_a = 0; index_a < packets_a.Size(); ++index_a) {
+    const Packet packet_a = packets_a[index_a];
+    if (!SelectRange(packet_a, range_a_, start, end)) continue;
+    HashBuckets::Bucket* bucket = index_b.Find(packets_a.GetHash(index_a));
+    if (bucket == nullptr) continue;
+
+    while (bucket->first_unmatched < bucket->end &&
+           packets_b.IsMatched(index_b.Candidate(bucket->first_unmatched))) {
+      bucket->first_unmatched++;
+    }
+    // Hash collisions mean a candidate may still have different contents
+    for (size_t i = bucket->first_unmatched; i < bucket->end; ++i) {
+      uint32_t candidate = index_b.Candidate(i);
+      if (!packets_b.IsMatched(candidate) &&
+          ComparePacket(packet_a, packets_b[candidate])) {
+        SetMatch(packets_a, index_a, packets_b, candidate);
         break;
       }
     }
   }
 }
 
-void PacketDiff::FindMatchingLocationSearch(Packets& /*packets_a*/,
-                                            Packets& /*packets_b*/) {
-  throw std::runtime_error("Search method 'location' is currently unsupported");
+void PacketDiff::FindMatchingLocationSearch(Packets& packets_a,
+                                            Packets& packets_b) {
+  // Packet N in A can only match packet N in B. Any packets after the end
+  // of the shorter file are unmatched (i.e. added or removed).
+  // Work is split into blocks of 64 packets so that no two threads update
+  // the same word of the match bitsets.
+  size_t count = std::min(packets_a.Size(), packets_b.Size());
+  size_t num_blocks = (count + 63) / 64;
+  thread_pool_.ParallelFor(num_blocks, 64, [&](size_t begin, size_t end) {
+    for (size_t i = begin * 64; i < std::min(end * 64, count); ++i) {
+      if (ComparePacket(packets_a[i], packets_b[i])) {
+        SetMatch(packets_a, i, packets_b, i);
+      }
+    }
+  });
 }
 
-bool PacketDiff::ComparePacket(const Packet& packet_a,
-                               const Packet& packet_b) const {
-
-  size_t index_a = range_a_.first;
-  size_t index_b = range_b_.first;
-  size_t end_a = packet_a.data.size();
-  size_t end_b = packet_b.data.size();
+void PacketDiff::FindMatchingSequenceSearch(Packets& packets_a,
+                                            Packets& packets_b) {
+  // Aligns the two files like diff(1) aligns lines, ignoring timestamps.
+  auto equal = [&](size_t index_a, size_t index_b) {
+    return ComparePacket(packets_a, index_a, packets_b, index_b);
+  };
+  auto match = [&](size_t index_a, size_t index_b) {
+    SetMatch(packets_a, index_a, packets_b, index_b);
+  };
+  AlignSequences(packets_a.Size(), packets_b.Size(), equal, match);
+}
 
-  if (index_a >= packet_a.data.size()) return false;
-  if (range_a_.second <= 0) {
-    end_a += range_a_.second;
-  } else {
-    end_a = static_cast<size_t>(range_a_.second);
+void PacketDiff::FindMatchingByFlow(Packets& packets_a, Packets& packets_b) {
+  // Each flow is searched with the single threaded version of the search
+  // method, so that the flows can be spread across the threads instead
+  if (search_method_ == SearchMethod::Location || track_drift_) {
+    throw std::runtime_error("Matching by flow is not supported by the "
+                             "location search method or with drift "
+                             "tracking");
   }
-  if (end_a > packet_a.data.size()) return false;
 
-  if (index_b >= packet_b.data.size()) return false;
-  if (range_b_.second <= 0) {
-    end_b += range_b_.second;
-  } else {
-    end_b = static_cast<size_t>(range_b_.second);
+  // Flows are numbered in order of appearance in A then B
+  std::unordered_map<uint64_t, uint32_t> flow_ids;
+  auto number = [&](const std::vector<uint64_t>& keys) {
+    std::vector<uint32_t> ids(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      ids[i] = flow_ids.emplace(keys[i], flow_ids.size()).first->second;
+    }
+    return ids;
+  };
+  std::vector<uint32_t> ids_a = number(GetFlowKeys(packets_a));
+  std::vector<uint32_t> ids_b = number(GetFlowKeys(packets_b));
+  size_t num_flows = flow_ids.size();
+
+  // Counting sort of the packet indexes by flow, which keeps each flow in
+  // file order. Flow f is indexes[begin[f]] to indexes[begin[f + 1] - 1].
+  auto group = [&](const std::vector<uint32_t>& ids,
+                   std::vector<uint32_t>& indexes,
+                   std::vector<size_t>& begin) {
+    begin.assign(num_flows + 1, 0);
+    for (uint32_t id : ids) {
+      begin[id + 1]++;
+    }
+    for (size_t f = 0; f < num_flows; ++f) {
+      begin[f + 1] += begin[f];
+    }
+    std::vector<size_t> next(begin.begin(), begin.end() - 1);
+    indexes.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+      indexes[next[ids[i]]++] = static_cast<uint32_t>(i);
+    }
+  };
+  std::vector<uint32_t> indexes_a, indexes_b;
+  std::vector<size_t> begin_a, begin_b;
+  group(ids_a, indexes_a, begin_a);
+  group(ids_b, indexes_b, begin_b);
+  auto size_a = [&](size_t f) { return begin_a[f + 1] - begin_a[f]; };
+  auto size_b = [&](size_t f) { return begin_b[f + 1] - begin_b[f]; };
+
+  // Flows that are only in one of the files can't have any matches. The
+  // largest flows go first, so that no thread is left with a large flow
+  // to search after the others have finished.
+  std::vector<uint32_t> flows;
+  for (size_t f = 0; f < num_flows; ++f) {
+    if (size_a(f) > 0 && size_b(f) > 0) {
+      flows.push_back(static_cast<uint32_t>(f));
+    }
   }
-  if (end_b > packet_b.data.size()) return false;
+  std::sort(flows.begin(), flows.end(), [&](uint32_t x, uint32_t y) {
+    return size_a(x) + size_b(x) > size_a(y) + size_b(y);
+  });
+
+  // Matches are set once all flows are done, as packets of different flows
+  // share words of the match bitsets
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> matches(
+      flows.size());
+  thread_pool_.ParallelForEach(flows.size(), [&](size_t i) {
+    size_t f = flows[i];
+    const uint32_t* flow_indexes_a = &indexes_a[begin_a[f]];
+    const uint32_t* flow_indexes_b = &indexes_b[begin_b[f]];
+    Packets flow_a = packets_a.Subset(flow_indexes_a, size_a(f));
+    Packets flow_b = packets_b.Subset(flow_indexes_b, size_b(f));
+    if (search_method_ == SearchMethod::Timestamp) {
+      FindMatchingTimestampSearch(flow_a, flow_b);
+    } else if (search_method_ == SearchMethod::Full) {
+      FindMatchingFullSearch(flow_a, flow_b);
+    } else { // search_method_ == SearchMethod::Sequence
+      FindMatchingSequenceSearch(flow_a, flow_b);
+    }
+    for (size_t j = 0; j < flow_a.Size(); ++j) {
+      if (flow_a.IsMatched(j)) {
+        matches[i].emplace_back(flow_indexes_a[j],
+                                flow_indexes_b[flow_a.GetMatch(j)]);
+      }
+    }
+  });
+  for (const auto& flow_matches : matches) {
+    for (const auto& match : flow_matches) {
+      SetMatch(packets_a, match.first, packets_b, match.second);
+    }
+  }
+}
+
+std::vector<uint64_t> PacketDiff::GetFlowKeys(const Packets& packets) {
+  std::vector<uint64_t> keys(packets.Size());
+  uint32_t link_layer = packets.GetLinkLayer();
+  thread_pool_.ParallelFor(packets.Size(), 4096, [&](size_t begin,
+                                                     size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      keys[i] = FlowKey::Get(packets[i], link_layer);
+    }
+  });
+  return keys;
+}
+
+void PacketDiff::SetMatch(Packets& packets_a, size_t index_a,
+                          Packets& packets_b, size_t index_b) {
+  packets_a.SetMatch(index_a, index_b);
+  packets_b.SetMatch(index_b, index_a);
+}
+
+bool PacketDiff::ComparePacket(const Packets& packets_a, size_t index_a,
+                               const Packets& packets_b,
+                               size_t index_b) const {
+  // Most packets that differ have different hashes, so the packet data
+  // is only read for packets that are probably equal
+  return packets_a.GetHash(index_a) == packets_b.GetHash(index_b) &&
+         ComparePacket(packets_a[index_a], packets_b[index_b]);
+}
+
+bool PacketDiff::ComparePacket(const Packet& packet_a,
+                               const Packet& packet_b) const {
+
+  size_t index_a, end_a, index_b, end_b;
+  if (!SelectRange(packet_a, range_a_, index_a, end_a)) return false;
+  if (!SelectRange(packet_b, range_b_, index_b, end_b)) return false;
 
   if ((end_a - index_a) != end_b - index_b) return false;
+  if (end_a <= index_a) return true;
 
   // Mask is likely much smaller than the packet.
   // Mask is applied from the start offset of each packet.
   // After the mask finishes, all bytes are compared.
   // We know that length of packets is the same (taking into account
   // start / end offset).
-  size_t index_mask =  0;
-  while (index_mask < mask_.size() && index_a < end_a) {
-    if (mask_[index_mask] == 1 &&
-        (packet_a.data[index_a] != packet_b.data[index_b])) {
-      return false;
+  size_t length = end_a - index_a;
+  size_t masked_length = std::min(length, mask_.Size());
+  const uint8_t* data_a = packet_a.data + index_a;
+  const uint8_t* data_b = packet_b.data + index_b;
+
+  if (!masked_compare_(data_a, data_b, mask_.Data(), masked_length)) {
+    return false;
+  }
+  return std::memcmp(data_a + masked_length, data_b + masked_length,
+                     length - masked_length) == 0;
+}
+
+bool PacketDiff::SelectRange(const Packet& packet,
+                             const std::pair<size_t, int>& range,
+                             size_t& start, size_t& end) {
+  start = range.first;
+  end = packet.Size();
+
+  if (start >= packet.Size()) return false;
+  if (range.second <= 0) {
+    end += range.second;
+  } else {
+    end = static_cast<size_t>(range.second);
+  }
+  return end <= packet.Size();
+}
+
+PacketDiff::TimeAlignment PacketDiff::EstimateTimeOffset(
+    Packets& packets_a, Packets& packets_b) {
+  // At most around kMaxSamples packets are sampled from each file, so
+  // memory use doesn't grow with the file size. Packets that appear more
+  // than kMaxDuplicates times in a sample (e.g. keepalives) are skipped,
+  // as their pairings are mostly wrong.
+  const uint64_t kMaxSamples = 1 << 20;
+  const size_t kMaxDuplicates = 8;
+  uint64_t rate = std::max<uint64_t>(
+      1, std::max(packets_a.Size(), packets_b.Size()) / kMaxSamples);
+  // The hashes are kept for the search that follows
+  HashPackets(packets_a, range_a_);
+  HashPackets(packets_b, range_b_);
+  std::vector<std::pair<uint64_t, int64_t>> samples_a =
+      SampleHashes(packets_a, range_a_, rate);
+  std::vector<std::pair<uint64_t, int64_t>> samples_b =
+      SampleHashes(packets_b, range_b_, rate);
+
+  // Sorted hash join, collecting the time from each packet in A to every
+  // identical packet in B
+  std::vector<int64_t> deltas;
+  auto it_a = samples_a.begin();
+  auto it_b = samples_b.begin();
+  while (it_a != samples_a.end() && it_b != samples_b.end()) {
+    if (it_a->first < it_b->first) {
+      ++it_a;
+    } else if (it_b->first < it_a->first) {
+      ++it_b;
+    } else {
+      auto end_a = it_a;
+      auto end_b = it_b;
+      while (end_a != samples_a.end() && end_a->first == it_a->first) ++end_a;
+      while (end_b != samples_b.end() && end_b->first == it_b->first) ++end_b;
+      if (static_cast<size_t>(end_a - it_a) <= kMaxDuplicates &&
+          static_cast<size_t>(end_b - it_b) <= kMaxDuplicates) {
+        for (auto a = it_a; a != end_a; ++a) {
+          for (auto b = it_b; b != end_b; ++b) {
+            deltas.push_back(a->second - b->second);
+          }
+        }
+      }
+      it_a = end_a;
+      it_b = end_b;
     }
-    index_a++;
-    index_b++;
-    index_mask++;
   }
-  
-  while (index_a < end_a) {
-    if (packet_a.data[index_a] != packet_b.data[index_b]) {
-      return false;
+
+  TimeAlignment alignment{0, deltas.size(), 0};
+  if (deltas.empty()) {
+    return alignment;
+  }
+  // The histogram peak is the time window holding the most deltas. The
+  // window is as wide as the matching window, so that every pair in the
+  // peak can match once the offset is applied.
+  std::sort(deltas.begin(), deltas.end());
+  int64_t width = std::max<int64_t>(time_range_.first.ns +
+                                    time_range_.second.ns, 1000);
+  size_t best_begin = 0;
+  size_t best_end = 0;
+  for (size_t begin = 0, end = 0; begin < deltas.size(); ++begin) {
+    while (end < deltas.size() && deltas[end] - deltas[begin] <= width) {
+      end++;
+    }
+    if (end - begin > best_end - best_begin) {
+      best_begin = begin;
+      best_end = end;
     }
-    index_a++;
-    index_b++;
   }
+  // Centre on the median of the peak, which is more precise than the
+  // window position
+  alignment.offset_ns = deltas[best_begin + (best_end - best_begin) / 2];
+  alignment.num_agreeing = best_end - best_begin;
+  return alignment;
+}
 
-  return true;
+std::vector<std::pair<uint64_t, int64_t>> PacketDiff::SampleHashes(
+    const Packets& packets, const std::pair<size_t, int>& range,
+    uint64_t rate) {
+  // Each block of packets is sampled separately, then the blocks are
+  // joined in order
+  const uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+  const size_t kBlockSize = 65536;
+  size_t num_blocks = (packets.Size() + kBlockSize - 1) / kBlockSize;
+  std::vector<std::vector<std::pair<uint64_t, int64_t>>> blocks(num_blocks);
+  thread_pool_.ParallelFor(num_blocks, 1, [&](size_t begin, size_t end) {
+    size_t start, stop;
+    for (size_t block = begin; block < end; ++block) {
+      size_t last = std::min(packets.Size(), (block + 1) * kBlockSize);
+      for (size_t i = block * kBlockSize; i < last; ++i) {
+        const Packet packet = packets[i];
+        if (!SelectRange(packet, range, start, stop)) continue;
+        uint64_t hash = packets.GetHash(i);
+        if (((hash * kMultiplier) >> 32) % rate == 0) {
+          blocks[block].emplace_back(hash, packet.time.ns);
+        }
+      }
+    }
+  });
+  std::vector<std::pair<uint64_t, int64_t>> samples;
+  for (const auto& block : blocks) {
+    samples.insert(samples.end(), block.begin(), block.end());
+  }
+  std::sort(samples.begin(), samples.end());
+  return samples;
+}
+
+void PacketDiff::HashPackets(Packets& packets,
+                             const std::pair<size_t, int>& range) {
+  // Hashes loaded from a packet index are reused as they are
+  if (packets.HasHashes()) return;
+  std::vector<uint64_t> hashes(packets.Size());
+  thread_pool_.ParallelFor(packets.Size(), 4096, [&](size_t begin,
+                                                     size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      hashes[i] = HashPacket(packets[i], range);
+    }
+  });
+  packets.SetHashes(std::move(hashes));
+}
+
+uint64_t PacketDiff::GetSettingsKey(const std::string& mask,
+                                    const std::string& range) {
+  // Parsed first, so equivalent settings give the same key. Each hash
+  // kernel gives different hashes, so it is part of the key too.
+  const uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+  MaskedCompare::ByteMask byte_mask(MaskStringToVector(mask));
+  std::pair<size_t, int> byte_range = RangeStringToPair(range);
+  uint64_t key = (byte_range.first ^ kMultiplier) * kMultiplier;
+  key = (key ^ static_cast<uint32_t>(byte_range.second)) * kMultiplier;
+  key = (key ^ byte_mask.Size()) * kMultiplier;
+  for (size_t i = 0; i < byte_mask.Size(); ++i) {
+    key = (key ^ byte_mask.Data()[i]) * kMultiplier;
+  }
+  for (const char* name = ContentHash::SelectedName(); *name; ++name) {
+    key = (key ^ static_cast<uint8_t>(*name)) * kMultiplier;
+  }
+  return key ^ (key >> 32);
+}
+
+uint64_t PacketDiff::HashPacketA(const Packet& packet) const {
+  return HashPacket(packet, range_a_);
+}
+
+uint64_t PacketDiff::HashPacketB(const Packet& packet) const {
+  return HashPacket(packet, range_b_);
+}
+
+uint64_t PacketDiff::HashPacket(const Packet& packet,
+                                const std::pair<size_t, int>& range) const {
+  // Only the bytes that ComparePacket looks at are hashed, so packets that
+  // compare equal always have the same hash. Masked bytes are cleared.
+  size_t index, end;
+  if (!SelectRange(packet, range, index, end)) return 0;
+  // A range that ends before it starts selects no bytes
+  if (end <= index) end = index;
+  return content_hash_(packet.data + index, end - index, mask_.Data(),
+                       mask_.Size());
 }
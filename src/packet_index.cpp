@@ -0,0 +1,28 @@
+#include <sys/stat.h>
+
+#include <packet_index.h>
+
+
+std::string PacketIndex::GetPath(const std::string& pcap_path) {
+  return pcap_path + ".pdidx";
+}
+
+bool PacketIndex::GetSourceKey(const std::string& pcap_path,
+                               SourceKey& key) {
+  struct stat sb;
+  if (stat(pcap_path.c_str(), &sb) == -1 || !S_ISREG(sb.st_mode)) {
+    return false;
+  }
+  key.size = static_cast<uint64_t>(sb.st_size);
+  key.mtime_ns = int64_t(sb.st_mtim.tv_sec) * 1000000000 +
+                 sb.st_mtim.tv_nsec;
+  return true;
+}
+
+size_t PacketIndex::GetFileSize(uint64_t num_packets, bool hashes) {
+  size_t per_packet = sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint32_t);
+  if (hashes) {
+    per_packet += sizeof(uint64_t);
+  }
+  return sizeof(FileHeader) + num_packets * per_packet;
+}
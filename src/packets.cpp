@@ -1,81 +1,341 @@
 #include <sstream>
 #include <iomanip>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
 
 #include <packets.h>
 #include <timestamp.h>
+#include <thread_pool.h>
+#include <packet_index.h>
 
 
+constexpr uint32_t Packets::kNoMatch;
+
+static_assert(sizeof(Timestamp) == sizeof(int64_t),
+              "Timestamps are stored in the index as 64 bit integers");
+
 Packets::Packets() 
-    : link_layer_(0) { }
+    : time_offset_ns_(0), link_layer_(0), nanosecond_(false), base_(0) { }
+
+void Packets::Load(const PcapReader& reader, uint64_t max_packets,
+                   size_t num_threads) {
+  times_.clear();
+  lengths_.clear();
+  offsets_.clear();
+  hashes_.clear();
+  time_offset_ns_ = 0;
+  link_layer_ = reader.GetLinkLayer();
+  nanosecond_ = reader.IsNanosecond();
+  SetSource(reader.GetFile());
+
+  // The file is scanned from start to end, so the kernel can read further
+  // ahead than usual. Packet data is read again in any order when matching.
+  reader.GetFile()->Advise(MappedFile::Access::Sequential);
+  if (reader.CanIndex()) {
+    LoadIndexed(reader, max_packets, num_threads);
+  } else {
+    // Allow the user to only load the first max_packets packets
+    PcapReader::Cursor cursor = reader.Begin();
+    Packet packet;
+    while ((max_packets == 0 || times_.size() < max_packets) &&
+           reader.Next(cursor, packet)) {
+      times_.push_back(packet.time);
+      lengths_.push_back(packet.length);
+      offsets_.push_back(reinterpret_cast<uintptr_t>(packet.data) - base_);
+    }
+  }
+  reader.GetFile()->Advise(MappedFile::Access::Normal);
 
-void Packets::Load(std::vector<Packet> packets, uint32_t link_layer) {
-    packets_ = std::move(packets);
-    link_layer_ = link_layer;
+  CheckLoaded(reader.GetFilename());
 }
 
-Packet& Packets::operator[](size_t index) {
-  return packets_[index];
+void Packets::Load(const CaptureSet& captures, uint64_t max_packets,
+                   size_t num_threads) {
+  // A single file can be loaded in parallel
+  if (captures.NumFiles() == 1) {
+    Load(captures.GetReader(0), max_packets, num_threads);
+    return;
+  }
+  times_.clear();
+  lengths_.clear();
+  offsets_.clear();
+  hashes_.clear();
+  time_offset_ns_ = 0;
+  link_layer_ = captures.GetLinkLayer();
+  nanosecond_ = captures.IsNanosecond();
+  SetSource(captures.GetReader(0).GetFile());
+  for (size_t i = 1; i < captures.NumFiles(); ++i) {
+    sources_.push_back(captures.GetReader(i).GetFile());
+  }
+
+  for (const auto& source : sources_) {
+    source->Advise(MappedFile::Access::Sequential);
+  }
+  CaptureSet::Cursor cursor = captures.Begin();
+  Packet packet;
+  while ((max_packets == 0 || times_.size() < max_packets) &&
+         captures.Next(cursor, packet)) {
+    times_.push_back(packet.time);
+    lengths_.push_back(packet.length);
+    offsets_.push_back(reinterpret_cast<uintptr_t>(packet.data) - base_);
+  }
+  for (const auto& source : sources_) {
+    source->Advise(MappedFile::Access::Normal);
+  }
+
+  CheckLoaded(captures.GetFilename());
 }
 
-const Packet& Packets::operator[](size_t index) const {
-  return packets_[index];
+void Packets::SetSource(std::shared_ptr<const MappedFile> source) {
+  base_ = reinterpret_cast<uintptr_t>(source->Data());
+  sources_.assign(1, std::move(source));
+}
+
+void Packets::CheckLoaded(const std::string& filename) {
+  if (times_.size() == 0) {
+    throw std::runtime_error("Failed to parse file: " + filename + "\n"
+                             "File contains no packets.");
+  }
+  // Matches are stored as 32 bit indexes
+  if (times_.size() >= kNoMatch) {
+    throw std::runtime_error("Failed to parse file: " + filename + "\n"
+                             "File contains too many packets.");
+  }
+
+  matched_.assign((times_.size() + 63) / 64, 0);
+  match_index_.assign(times_.size(), kNoMatch);
+}
+
+bool Packets::LoadIndex(const PcapReader& reader,
+                        const std::string& index_path,
+                        uint64_t settings_key, uint64_t max_packets) {
+  std::unique_ptr<MappedFile> index;
+  try {
+    index.reset(new MappedFile(index_path));
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+
+  PacketIndex::FileHeader header;
+  PacketIndex::SourceKey source;
+  if (index->Size() < sizeof(header) ||
+      !PacketIndex::GetSourceKey(reader.GetFilename(), source)) {
+    return false;
+  }
+  std::memcpy(&header, index->Data(), sizeof(header));
+  bool stored_hashes = header.flags & PacketIndex::kFlagHashes;
+  if (header.magic_number != PacketIndex::kMagic ||
+      header.version != PacketIndex::kVersion ||
+      header.pcap_size != source.size ||
+      header.pcap_mtime_ns != source.mtime_ns ||
+      header.link_type != reader.GetLinkLayer() ||
+      index->Size() != PacketIndex::GetFileSize(header.num_packets,
+                                                stored_hashes)) {
+    return false;
+  }
+
+  size_t num_stored = header.num_packets;
+  size_t num_packets = num_stored;
+  if (max_packets != 0 && max_packets < num_packets) {
+    num_packets = max_packets;
+  }
+  // Columns are copied out of the mapped index with no further parsing
+  const uint8_t* column = index->Data() + sizeof(header);
+  times_.resize(num_packets);
+  std::memcpy(times_.data(), column, num_packets * sizeof(Timestamp));
+  column += num_stored * sizeof(Timestamp);
+  offsets_.resize(num_packets);
+  std::memcpy(offsets_.data(), column, num_packets * sizeof(uint64_t));
+  column += num_stored * sizeof(uint64_t);
+  hashes_.clear();
+  if (stored_hashes) {
+    if (header.settings_key == settings_key) {
+      hashes_.resize(num_packets);
+      std::memcpy(hashes_.data(), column, num_packets * sizeof(uint64_t));
+    }
+    column += num_stored * sizeof(uint64_t);
+  }
+  lengths_.resize(num_packets);
+  std::memcpy(lengths_.data(), column, num_packets * sizeof(uint32_t));
+
+  // The header can't vouch for the columns, and packets are read straight
+  // from the stored offsets, so a corrupt index must not point past the
+  // end of the file
+  size_t pcap_size = reader.GetFile()->Size();
+  for (size_t i = 0; i < num_packets; ++i) {
+    if (offsets_[i] > pcap_size || lengths_[i] > pcap_size - offsets_[i]) {
+      times_.clear();
+      offsets_.clear();
+      hashes_.clear();
+      lengths_.clear();
+      return false;
+    }
+  }
+
+  time_offset_ns_ = 0;
+  link_layer_ = header.link_type;
+  nanosecond_ = header.flags & PacketIndex::kFlagNanosecond;
+  SetSource(reader.GetFile());
+  CheckLoaded(reader.GetFilename());
+  return true;
+}
+
+void Packets::SaveIndex(const std::string& pcap_path,
+                        const std::string& index_path,
+                        uint64_t settings_key) const {
+  PacketIndex::SourceKey source;
+  if (!PacketIndex::GetSourceKey(pcap_path, source)) {
+    return;
+  }
+  PacketIndex::FileHeader header{
+    PacketIndex::kMagic,
+    PacketIndex::kVersion,
+    source.size,
+    source.mtime_ns,
+    settings_key,
+    times_.size(),
+    link_layer_,
+    (nanosecond_ ? PacketIndex::kFlagNanosecond : 0) |
+        (HasHashes() ? PacketIndex::kFlagHashes : 0)
+  };
+
+  // Written under a temporary name, so a reader never sees a partial index
+  std::string temp_path = index_path + ".tmp";
+  {
+    MappedFile index(temp_path, true,
+                     PacketIndex::GetFileSize(times_.size(), HasHashes()));
+    uint8_t* column = index.DataWritable();
+    std::memcpy(column, &header, sizeof(header));
+    column += sizeof(header);
+    // Timestamps are stored without any offset applied
+    for (const auto& time : times_) {
+      int64_t ns = time.ns - time_offset_ns_;
+      std::memcpy(column, &ns, sizeof(int64_t));
+      column += sizeof(int64_t);
+    }
+    std::memcpy(column, offsets_.data(), offsets_.size() * sizeof(uint64_t));
+    column += offsets_.size() * sizeof(uint64_t);
+    if (HasHashes()) {
+      std::memcpy(column, hashes_.data(), hashes_.size() * sizeof(uint64_t));
+      column += hashes_.size() * sizeof(uint64_t);
+    }
+    std::memcpy(column, lengths_.data(), lengths_.size() * sizeof(uint32_t));
+  }
+  if (std::rename(temp_path.c_str(), index_path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    throw std::runtime_error("Failed to create file: " + index_path);
+  }
+}
+
+void Packets::LoadIndexed(const PcapReader& reader, uint64_t max_packets,
+                          size_t num_threads) {
+  // The serial pass only finds where each packet starts. That gives the
+  // exact packet count, so the other columns are sized once and filled in
+  // parallel. offsets_ holds header offsets until the packet is decoded.
+  reader.IndexPackets(offsets_, max_packets);
+  size_t num_packets = offsets_.size();
+  if (num_packets == 0) {
+    // Reported by Load
+    return;
+  }
+  if (num_packets >= kNoMatch) {
+    throw std::runtime_error("Failed to parse file: " +
+                             reader.GetFilename() + "\n"
+                             "File contains too many packets.");
+  }
+  times_.resize(num_packets);
+  lengths_.resize(num_packets);
+
+  ThreadPool thread_pool(num_threads);
+  thread_pool.ParallelFor(num_packets, 16384, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      Packet packet = reader.ReadIndexed(offsets_[i], i);
+      times_[i] = packet.time;
+      lengths_[i] = packet.length;
+      offsets_[i] = reinterpret_cast<uintptr_t>(packet.data) - base_;
+    }
+  });
+}
+
+void Packets::SetMatch(size_t index, uint32_t match_index) {
+  matched_[index / 64] |= uint64_t(1) << (index % 64);
+  match_index_[index] = match_index;
+}
+
+size_t Packets::NumMatched() const {
+  size_t num_matched = 0;
+  for (uint64_t word : matched_) {
+    num_matched += __builtin_popcountll(word);
+  }
+  return num_matched;
 }
 
 std::string Packets::GetMetadataString() const {
-  if (packets_.size() == 0) {
+  if (times_.size() == 0) {
     throw std::runtime_error("Cannot print packet metadata. "
                              "No packets loaded");
   }
   std::ostringstream oss;  
-  oss << "Num packets: " << std::setw(9) << packets_.size();
+  oss << "Num packets: " << std::setw(9) << times_.size();
   oss << ". Link type: 0x" << std::hex << std::setfill('0');
   oss << std::setw(9) << link_layer_ << std::dec;
-  oss << ". Start Time: " << packets_[0].header.time.PrintTime();
+  oss << ". Start Time: " << times_[0].PrintTime();
   return oss.str();
 }
 
 std::string Packets::GetStartTimeString() const {
-  return packets_[0].header.time.PrintTime();
+  return times_[0].PrintTime();
 }
 
 uint32_t Packets::GetLinkLayer() const {
   return link_layer_;
 }
 
+bool Packets::IsNanosecond() const {
+  return nanosecond_;
+}
+
 void Packets::OffsetTimestamps(double time_offset) {
 
   if (time_offset != 0.0) {
-    if (time_offset > 0.0) {
-      Timestamp offset(time_offset);
-      for (auto& packet : packets_) {
-        packet.header.time += offset;
-      }
-    } else {
-      Timestamp offset(-time_offset);
-      for (auto& packet : packets_) {
-        packet.header.time -= offset;
-      }
+    // A single signed add per packet, so the loop can be vectorised
+    int64_t offset = time_offset > 0.0 ? Timestamp(time_offset).ns
+                                       : -Timestamp(-time_offset).ns;
+    for (auto& time : times_) {
+      time.ns += offset;
     }
+    time_offset_ns_ += offset;
   }
 
 }
 
-std::vector<Packet>::iterator Packets::begin() {
-  return packets_.begin();
+void Packets::SetHashes(std::vector<uint64_t>&& hashes) {
+  hashes_ = std::move(hashes);
 }
 
-std::vector<Packet>::iterator Packets::end() {
-  return packets_.end();
-}
-
-const std::vector<Packet>::const_iterator Packets::begin() const {
-  return packets_.begin();
-}
-
-const std::vector<Packet>::const_iterator Packets::end() const {
-  return packets_.end();
+Packets Packets::Subset(const uint32_t* indexes, size_t count) const {
+  Packets subset;
+  subset.times_.reserve(count);
+  subset.lengths_.reserve(count);
+  subset.offsets_.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    subset.times_.push_back(times_[indexes[i]]);
+    subset.lengths_.push_back(lengths_[indexes[i]]);
+    subset.offsets_.push_back(offsets_[indexes[i]]);
+  }
+  if (HasHashes()) {
+    subset.hashes_.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+      subset.hashes_.push_back(hashes_[indexes[i]]);
+    }
+  }
+  subset.matched_.assign((count + 63) / 64, 0);
+  subset.match_index_.assign(count, kNoMatch);
+  subset.time_offset_ns_ = time_offset_ns_;
+  subset.link_layer_ = link_layer_;
+  subset.nanosecond_ = nanosecond_;
+  subset.sources_ = sources_;
+  subset.base_ = base_;
+  return subset;
 }
-
-size_t Packets::Size() const {
-  return packets_.size();
-}
\ No newline at end of file
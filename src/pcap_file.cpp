@@ -1,9 +1,17 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PCAP_DIFF_X86
+#endif
+
 #include <pcap_file.h>
 
-struct PcapFile::FileHeader PcapFile::GetStandardHeader(uint32_t link_layer) {
+struct PcapFile::FileHeader PcapFile::GetStandardHeader(uint32_t link_layer,
+                                                     bool nanosecond) {
 
   FileHeader file_header{
-    0xA1B2C3D4, // magic_number
+    nanosecond ? kMagicNanoseconds : kMagicMicroseconds, // magic_number
     4,          // major_version
     2,          // minor_version
     0,          // thiszone
@@ -13,4 +21,60 @@ struct PcapFile::FileHeader PcapFile::GetStandardHeader(uint32_t link_layer) {
   };
 
   return file_header;
-}
\ No newline at end of file
+}
+
+void PcapFile::SwapFileHeader(FileHeader& header) {
+  header.magic_number = __builtin_bswap32(header.magic_number);
+  header.major_version = __builtin_bswap16(header.major_version);
+  header.minor_version = __builtin_bswap16(header.minor_version);
+  header.thiszone = __builtin_bswap32(header.thiszone);
+  header.sigfigs = __builtin_bswap32(header.sigfigs);
+  header.snap_length = __builtin_bswap32(header.snap_length);
+  header.link_type = __builtin_bswap32(header.link_type);
+}
+
+namespace {
+
+  static_assert(sizeof(PcapFile::PacketHeader) == 16,
+                "Packet header must fill one 128 bit vector");
+
+  void ReadNative(const uint8_t* data, PcapFile::PacketHeader& header) {
+    std::memcpy(&header, data, sizeof(PcapFile::PacketHeader));
+  }
+
+  void ReadSwappedScalar(const uint8_t* data,
+                         PcapFile::PacketHeader& header) {
+    std::memcpy(&header, data, sizeof(PcapFile::PacketHeader));
+    header.ts_sec = __builtin_bswap32(header.ts_sec);
+    header.ts_frac = __builtin_bswap32(header.ts_frac);
+    header.incl_len = __builtin_bswap32(header.incl_len);
+    header.orig_len = __builtin_bswap32(header.orig_len);
+  }
+
+#ifdef PCAP_DIFF_X86
+  // All four 32 bit fields are reversed with one byte shuffle
+  __attribute__((target("ssse3")))
+  void ReadSwappedSsse3(const uint8_t* data,
+                        PcapFile::PacketHeader& header) {
+    const __m128i shuffle = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                         4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i fields = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&header),
+                     _mm_shuffle_epi8(fields, shuffle));
+  }
+#endif
+
+}
+
+PcapFile::ReadFunction PcapFile::SelectReader(bool swapped) {
+  if (!swapped) {
+    return ReadNative;
+  }
+#ifdef PCAP_DIFF_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    return ReadSwappedSsse3;
+  }
+#endif
+  return ReadSwappedScalar;
+}
@@ -1,119 +1,673 @@
 #include <stdexcept>
 #include <cstring>
+#include <algorithm>
+#include <limits>
 #include <pcap_reader.h>
+#include <decompressor.h>
 #include <iostream>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+namespace {
+  // Largest packet that libpcap will capture (MAXIMUM_SNAPLEN). Used to
+  // decide if a packet header found while seeking is plausible.
+  constexpr uint32_t kMaxPlausibleLength = 262144;
+  // Number of consecutive plausible headers needed to resynchronise, unless
+  // they first reach a known packet boundary
+  constexpr int kResyncPackets = 16;
 
-PcapReader::PcapReader(const std::string& path)
-    : pcap_file_(path), filename_(path) {
+  // Offset of a cursor that has reached the end of the time window
+  constexpr size_t kEndOffset = std::numeric_limits<size_t>::max();
 
+  // Pipes and compressed files are read into memory, and then read in the
+  // same way as a mapped file. A path of "-" is stdin. With a streamed
+  // input, everything but a file mapped without compression is instead
+  // parsed as it is read.
+  void OpenFile(const std::string& path, const IoBackend::Options& io_options,
+                std::shared_ptr<const MappedFile>& file,
+                std::shared_ptr<InputStream>& stream) {
+    struct stat sb;
+    bool is_stdin = path == "-";
+    if (is_stdin || (stat(path.c_str(), &sb) == 0 && !S_ISREG(sb.st_mode) &&
+                     !S_ISBLK(sb.st_mode))) {
+      int fd = is_stdin ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+      if (fd == -1) {
+        throw std::runtime_error("Failed to open file: " + path);
+      }
+      if (io_options.streamed) {
+        stream = Decompressor::OpenStream(fd, !is_stdin,
+                                          io_options.huge_pages);
+      } else {
+        try {
+          file = Decompressor::ReadStream(fd, is_stdin ? "stdin" : path);
+        } catch (...) {
+          if (!is_stdin) close(fd);
+          throw;
+        }
+        if (!is_stdin) close(fd);
+      }
+    } else if (io_options.streamed &&
+               io_options.type != IoBackend::Type::Mmap) {
+      stream = IoBackend::Stream(path, io_options);
+    } else {
+      file = IoBackend::Read(path, io_options);
+    }
+
+    Decompressor::Format format;
+    if (stream) {
+      try {
+        format = stream->WaitFor(4) < 4 ? Decompressor::Format::None :
+            Decompressor::DetectFormat(stream->Get(0, 4), 4);
+      } catch (const std::runtime_error& error) {
+        throw std::runtime_error("Failed to parse file: " + path + "\n" +
+                                 error.what());
+      }
+    } else {
+      format = Decompressor::DetectFormat(*file);
+    }
+    if (format != Decompressor::Format::None) {
+      if (io_options.streamed) {
+        // Decompressed on a separate thread while it is parsed
+        if (stream) {
+          stream = Decompressor::OpenStream(std::move(stream), format, path,
+                                            io_options.huge_pages);
+        } else {
+          stream = Decompressor::OpenStream(std::move(file), format, path,
+                                            io_options.huge_pages);
+        }
+      } else {
+        file = Decompressor::Decompress(*file, format, path);
+      }
+    }
+    // Memory that has already been filled is collapsed into huge pages in
+    // the background
+    if (file && io_options.huge_pages) {
+      file->AdviseHugePages();
+    }
+  }
+}
+
+PcapReader::PcapReader(const std::string& path,
+                       const IoBackend::Options& io_options)
+    : read_header_(nullptr), filename_(path), nanosecond_(false),
+      windowed_(false), prefetch_(0) {
+
+  OpenFile(path, io_options, pcap_file_, stream_);
   // PCAP file must be at least as long as the main file header
-  if (pcap_file_.Size() < sizeof(PcapFile::FileHeader)) {
+  if (Available(sizeof(PcapFile::FileHeader)) <
+      sizeof(PcapFile::FileHeader)) {
     throw std::runtime_error("Failed to parse file: " + path + "\n"
                              "File is too small to be a PCAP file.");
   }
+  uint32_t block_type;
+  std::memcpy(&block_type, GetData(0, sizeof(uint32_t)), sizeof(uint32_t));
+  pcapng_ = block_type == PcapngFile::kSectionHeaderBlock;
+  if (pcapng_) {
+    ParsePcapngHeader();
+  } else {
+    ParsePcapHeader();
+  }
+}
+
+void PcapReader::ParsePcapHeader() {
   // Copy over PCAP file header for easy access
-  std::memcpy(&Header_, pcap_file_.Data(), sizeof(PcapFile::FileHeader));
+  std::memcpy(&Header_, GetData(0, sizeof(PcapFile::FileHeader)),
+              sizeof(PcapFile::FileHeader));
 
   // PCAP Magic number is:
-  // 0xA1B2C3D4: Microsecond timestamp (Supported)
-  // 0xA1B23C4D: Nanoseconds timestamp (Not Supported)
-  // 0xD4C3B2A1: Microsecond timestamp - Opposite endian (Not Supported)
-  // 0x4D3CB2A1: Nanoseconds timestamp - Opposite endian (Not Supported)
-
-  // Check the magic number is not the nanoseconds magic number.
-  if (Header_.magic_number == 0xA1B23C4D) {
-    throw std::runtime_error("Failed to parse file: " + path + "\n"
-                              "PCAP file uses nanoseconds timestamps. "
-                              "Only PCAPs with microseconds timestamps are "
-                              "supported.");
-  }
-  // Check the PCAP is not using the opposite endian to the processor
-  if (Header_.magic_number == 0xD4C3B2A1 ||
-      Header_.magic_number == 0x4D3CB2A1) {
-    throw std::runtime_error("Failed to parse file: " + path + "\n"
-                              "PCAP file uses a different endian to this "
-                              "processor. Only PCAPs with the same endian to "
-                              "the processor running the program are "
-                              "supported.");
+  // 0xA1B2C3D4: Microsecond timestamp
+  // 0xA1B23C4D: Nanoseconds timestamp
+  // 0xD4C3B2A1: Microsecond timestamp - Opposite endian
+  // 0x4D3CB2A1: Nanoseconds timestamp - Opposite endian
+  // Files written on a processor of the opposite endian have every header
+  // field byte swapped as it is read. Packet data is never swapped.
+  bool swapped = Header_.magic_number == PcapFile::kMagicMicrosecondsSwapped ||
+                 Header_.magic_number == PcapFile::kMagicNanosecondsSwapped;
+  if (swapped) {
+    PcapFile::SwapFileHeader(Header_);
   }
+  read_header_ = PcapFile::SelectReader(swapped);
   // Check file is actually a PCAP file
-  if (Header_.magic_number != 0xA1B2C3D4) {
-    throw std::runtime_error("Failed to parse file: " + path + "\n"
+  if (Header_.magic_number != PcapFile::kMagicMicroseconds &&
+      Header_.magic_number != PcapFile::kMagicNanoseconds) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
                               "File is not a PCAP file.");
   }
+  nanosecond_ = Header_.magic_number == PcapFile::kMagicNanoseconds;
 
   // Only PCAP version 2.4 is supported. This is the version used
   // by wireshark and tcpdump.
   if (Header_.major_version != 2 || Header_.minor_version != 4) {
-    throw std::runtime_error("Failed to parse file: " + path + "\n"
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
                               "PCAP file version " +
                               std::to_string(Header_.major_version) + "." +
                               std::to_string(Header_.minor_version) + " "
                               "is not supported."
                               "Only version 2.4 is supported");
   }
+  link_layer_ = Header_.link_type;
 }
 
-std::vector<Packet> PcapReader::GetPackets(uint64_t max_packets) const {
-  // Get a pointer to the first byte after the PCAP global header
-  const uint8_t* packet_ptr = pcap_file_.Data() + sizeof(PcapFile::FileHeader);
-  const uint8_t* end_ptr = pcap_file_.Data() + pcap_file_.Size();
+void PcapReader::ParsePcapngHeader() {
+  // The link layer and timestamp resolution are taken from the interfaces
+  // defined before the first packet. Every interface must use the same
+  // link layer, as the packets are compared and written as one stream.
+  Cursor cursor = Begin();
+  link_layer_ = 0;
+  nanosecond_ = false;
+  PcapngFile::BlockHeader block;
+  const uint8_t* body = NextBlock(cursor.offset, block);
+  size_t body_length = block.block_total_length - 12;
+  ParseSectionHeader(body, body_length);
+  while ((body = NextBlock(cursor.offset, block)) != nullptr) {
+    if (block.block_type == PcapngFile::kInterfaceDescriptionBlock) {
+      PcapngFile::Interface interface;
+      if (!PcapngFile::ParseInterface(body, block.block_total_length - 12,
+                                      interface)) {
+        throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                                 "Interface description is corrupt.");
+      }
+      if (cursor.interfaces.empty()) {
+        link_layer_ = interface.link_type;
+      }
+      nanosecond_ = nanosecond_ || interface.nanosecond;
+      cursor.interfaces.push_back(interface);
+    } else if (block.block_type == PcapngFile::kEnhancedPacketBlock ||
+               block.block_type == PcapngFile::kSimplePacketBlock ||
+               block.block_type == PcapngFile::kPacketBlock) {
+      break;
+    }
+  }
+}
 
-  // We can't really reserve space as each packet has a variable length
-  // TODO: We could estimate this off the file size and typical packet length
-  std::vector<Packet> packets;
+void PcapReader::SetTimeWindow(Timestamp start, Timestamp end) {
+  windowed_ = true;
+  window_start_ = start;
+  window_end_ = end;
+}
 
-  // Loop through each packet header, read the size, and copy the header and 
-  // data into a vector.
-  while (packet_ptr + sizeof(PcapFile::PacketHeader) <= end_ptr) {
-    const auto* header_ptr = \
-        reinterpret_cast<const PcapFile::PacketHeader*>(packet_ptr);
+void PcapReader::SetPrefetch(size_t distance) {
+  prefetch_ = distance;
+}
 
-    if (header_ptr->incl_len != header_ptr->orig_len) {
+PcapReader::Cursor PcapReader::Begin() const {
+  // The Section Header Block is read like any other block. The first PCAP
+  // packet starts immediately after the global header. With a time window,
+  // packet indexes count from the start of the window.
+  uint64_t offset = pcapng_ ? 0 : sizeof(PcapFile::FileHeader);
+  if (windowed_ && !pcapng_ && !stream_) {
+    offset = SeekPcap(window_start_);
+  }
+  Cursor cursor{offset, 0, {}, Timestamp(), offset};
+  if (windowed_ && (pcapng_ || stream_)) {
+    // Blocks can't be found from an arbitrary offset, and streamed input
+    // can't be seeked, so these are read up to the start of the window
+    Cursor previous = cursor;
+    Packet packet;
+    while ((pcapng_ ? NextPcapng(cursor, packet) : NextPcap(cursor, packet)) &&
+           packet.time < window_start_) {
+      previous = cursor;
+      if (stream_) {
+        stream_->Release(previous.offset);
+      }
+    }
+    cursor = previous;
+    cursor.index = 0;
+    cursor.prefetched = cursor.offset;
+  }
+  return cursor;
+}
+
+bool PcapReader::Next(Cursor& cursor, Packet& packet) const {
+  if (cursor.offset == kEndOffset) {
+    return false;
+  }
+  if (prefetch_ != 0 && !stream_) {
+    Prefetch(cursor.offset, cursor.prefetched);
+  }
+  if (!(pcapng_ ? NextPcapng(cursor, packet) : NextPcap(cursor, packet))) {
+    return false;
+  }
+  if (windowed_ && packet.time > window_end_) {
+    // Nothing more is read once the window has ended
+    cursor.offset = kEndOffset;
+    return false;
+  }
+  return true;
+}
+
+uint64_t PcapReader::SeekPcap(Timestamp time) const {
+  // Bisect on the byte offset while the range is much larger than a packet,
+  // so that a packet always starts between the midpoint and the end. lo is
+  // always a packet boundary before the target, and hi is a boundary at or
+  // after it (or the end of the file). Packets are in time order, so every
+  // packet between them has a time between lo_time and hi_time.
+  const uint8_t* data = pcap_file_->Data();
+  uint64_t size = pcap_file_->Size();
+  uint64_t lo = sizeof(PcapFile::FileHeader);
+  uint64_t hi = size;
+  if (size - lo < sizeof(PcapFile::PacketHeader)) {
+    return lo;
+  }
+  PcapFile::PacketHeader header;
+  read_header_(data + lo, header);
+  Timestamp lo_time(header.ts_sec, header.ts_frac, nanosecond_);
+  Timestamp hi_time = Timestamp::FromNanoseconds(
+      std::numeric_limits<int64_t>::max());
+  const uint64_t kLinearScan =
+      4 * (sizeof(PcapFile::PacketHeader) + kMaxPlausibleLength);
+  while (hi - lo > kLinearScan) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint64_t offset = ResyncPcap(mid, hi, lo_time, hi_time);
+    if (offset == hi) {
+      break;
+    }
+    read_header_(data + offset, header);
+    Timestamp offset_time(header.ts_sec, header.ts_frac, nanosecond_);
+    if (offset_time < time) {
+      lo = offset + sizeof(PcapFile::PacketHeader) + header.incl_len;
+      lo_time = offset_time;
+    } else {
+      hi = offset;
+      hi_time = offset_time;
+    }
+  }
+  // Finish with a linear scan. Corrupt headers are left for Next to report.
+  while (size - lo >= sizeof(PcapFile::PacketHeader)) {
+    read_header_(data + lo, header);
+    if (Timestamp(header.ts_sec, header.ts_frac, nanosecond_) >= time ||
+        header.incl_len > size - lo - sizeof(PcapFile::PacketHeader)) {
+      break;
+    }
+    lo += sizeof(PcapFile::PacketHeader) + header.incl_len;
+  }
+  return lo;
+}
+
+uint64_t PcapReader::ResyncPcap(uint64_t offset, uint64_t limit,
+                                Timestamp min_time,
+                                Timestamp max_time) const {
+  // Returns the first offset in [offset, limit) that looks like the start
+  // of a packet, or limit if there is none
+  for (; offset < limit; ++offset) {
+    if (IsPlausiblePcap(offset, limit, min_time, max_time)) {
+      return offset;
+    }
+  }
+  return limit;
+}
+
+bool PcapReader::IsPlausiblePcap(uint64_t offset, uint64_t limit,
+                                 Timestamp min_time,
+                                 Timestamp max_time) const {
+  // A packet header is only accepted if it starts a chain of plausible
+  // headers, in time order and within [min_time, max_time], that lines up
+  // with the packet boundary at limit (or the end of the file), or that is
+  // kResyncPackets long. Empty packets are rejected, as runs of zero bytes
+  // are common in packet data.
+  uint64_t size = pcap_file_->Size();
+  uint32_t max_frac = nanosecond_ ? 1000000000 : 1000000;
+  Timestamp previous = min_time;
+  PcapFile::PacketHeader header;
+  for (int i = 0; i < kResyncPackets; ++i) {
+    if (offset == limit || offset == size) {
+      return true;
+    }
+    if (offset > limit || size - offset < sizeof(PcapFile::PacketHeader)) {
+      return false;
+    }
+    read_header_(pcap_file_->Data() + offset, header);
+    if (header.incl_len == 0 || header.incl_len != header.orig_len ||
+        header.incl_len > kMaxPlausibleLength ||
+        header.ts_frac >= max_frac ||
+        header.incl_len > size - offset - sizeof(PcapFile::PacketHeader)) {
+      return false;
+    }
+    Timestamp time(header.ts_sec, header.ts_frac, nanosecond_);
+    if (time < previous || max_time < time) {
+      return false;
+    }
+    previous = time;
+    offset += sizeof(PcapFile::PacketHeader) + header.incl_len;
+  }
+  return true;
+}
+
+bool PcapReader::NextPcap(Cursor& cursor, Packet& packet) const {
+  size_t header_end = cursor.offset + sizeof(PcapFile::PacketHeader);
+  size_t size = Available(header_end);
+  if (size < header_end) {
+    // The last packet should finish exactly at the end of the file.
+    // If it doesn't then something went wrong.
+    if (size != cursor.offset) {
       throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
-                               "Packet " + std::to_string(packets.size()) +
-                               " was truncated. Comparing PCAPs with truncated"
-                               " data captures is not supported.");
+                               "File appears truncated or corrupt.");
     }
+    return false;
+  }
+
+  PcapFile::PacketHeader header;
+  read_header_(GetData(cursor.offset, sizeof(PcapFile::PacketHeader)),
+               header);
 
-    packet_ptr += sizeof(PcapFile::PacketHeader);
+  size_t record_length = sizeof(PcapFile::PacketHeader) + header.incl_len;
+  if (Available(cursor.offset + record_length) - cursor.offset <
+      record_length) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                             "File appears truncated or corrupt.");
+  }
+  const uint8_t* record = GetData(cursor.offset, record_length);
+  packet = DecodePacket(header, record + sizeof(PcapFile::PacketHeader),
+                        cursor.index);
 
-    if (packet_ptr + header_ptr->incl_len > end_ptr) {
+  cursor.offset += record_length;
+  cursor.index++;
+  return true;
+}
+
+Packet PcapReader::DecodePacket(const PcapFile::PacketHeader& header,
+                               const uint8_t* data, size_t index) const {
+  if (header.incl_len != header.orig_len) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                             "Packet " + std::to_string(index) +
+                             " was truncated. Comparing PCAPs with truncated"
+                             " data captures is not supported.");
+  }
+  // The packet data is not copied, the packet points into the mapped file
+  return Packet{Timestamp(header.ts_sec, header.ts_frac, nanosecond_),
+                header.incl_len, data};
+}
+
+bool PcapReader::CanIndex() const {
+  return !pcapng_ && !stream_;
+}
+
+void PcapReader::IndexPackets(std::vector<uint64_t>& offsets,
+                              uint64_t max_packets) const {
+  // Only the packet lengths (and timestamps when there is a time window)
+  // are read here, everything else is checked by ReadIndexed
+  offsets.clear();
+  const uint8_t* data = pcap_file_->Data();
+  uint64_t size = pcap_file_->Size();
+  uint64_t offset = Begin().offset;
+  uint64_t prefetched = offset;
+  while ((max_packets == 0 || offsets.size() < max_packets) &&
+         size - offset >= sizeof(PcapFile::PacketHeader)) {
+    if (prefetch_ != 0) {
+      Prefetch(offset, prefetched);
+    }
+    PcapFile::PacketHeader header;
+    read_header_(data + offset, header);
+    if (header.incl_len > size - offset - sizeof(PcapFile::PacketHeader)) {
       throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
                                "File appears truncated or corrupt.");
     }
-    // Construct the header and data directly in the packets vector
-    // This should avoid unneeded copying / moving initially.
-    // Since the size of the vector will keep growing, it will likely be
-    // moved several times.
-    packets.emplace_back(Packet{*header_ptr, std::vector<uint8_t>(
-        packet_ptr, packet_ptr+header_ptr->incl_len), false, nullptr});
+    if (windowed_ && Timestamp(header.ts_sec, header.ts_frac, nanosecond_) >
+                     window_end_) {
+      return;
+    }
+    offsets.push_back(offset);
+    offset += sizeof(PcapFile::PacketHeader) + header.incl_len;
+  }
+  // The last packet should finish exactly at the end of the file
+  if (max_packets == 0 && offset != size) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                             "File appears truncated or corrupt.");
+  }
+}
 
-    packet_ptr += header_ptr->incl_len;
+void PcapReader::Prefetch(uint64_t offset, uint64_t& prefetched) const {
+  // Half the distance is requested at a time, so there is always at least
+  // half of it being read ahead of the parser
+  if (offset + prefetch_ / 2 < prefetched) {
+    return;
+  }
+  uint64_t start = std::max(offset, prefetched);
+  prefetched = offset + prefetch_;
+  pcap_file_->Prefetch(start, prefetched - start);
+}
 
-    // Allow the user to only load the first packet_counter packets
-    if (max_packets != 0 && packets.size() == max_packets) {
-      break;
+Packet PcapReader::ReadIndexed(uint64_t offset, size_t index) const {
+  const uint8_t* packet_ptr = pcap_file_->Data() + offset;
+  PcapFile::PacketHeader header;
+  read_header_(packet_ptr, header);
+  return DecodePacket(header, packet_ptr + sizeof(PcapFile::PacketHeader),
+                      index);
+}
+
+bool PcapReader::NextPcapng(Cursor& cursor, Packet& packet) const {
+  PcapngFile::BlockHeader block;
+  const uint8_t* body;
+  while ((body = NextBlock(cursor.offset, block)) != nullptr) {
+    size_t body_length = block.block_total_length - 12;
+    uint32_t interface_id = 0;
+    uint32_t timestamp_high = 0;
+    uint32_t timestamp_low = 0;
+    uint32_t captured_length;
+    uint32_t original_length;
+    size_t header_length;
+
+    switch (block.block_type) {
+      case PcapngFile::kSectionHeaderBlock:
+        // Interface IDs restart in each section
+        ParseSectionHeader(body, body_length);
+        cursor.interfaces.clear();
+        continue;
+      case PcapngFile::kInterfaceDescriptionBlock: {
+        PcapngFile::Interface interface;
+        if (!PcapngFile::ParseInterface(body, body_length, interface)) {
+          throw std::runtime_error("Failed to parse file: " + filename_ +
+                                   "\nInterface description is corrupt.");
+        }
+        if (interface.link_type != link_layer_) {
+          throw std::runtime_error("Failed to parse file: " + filename_ +
+                                   "\nInterfaces with different link layers "
+                                   "(" + std::to_string(link_layer_) + " and " +
+                                   std::to_string(interface.link_type) +
+                                   ") are not supported.");
+        }
+        cursor.interfaces.push_back(interface);
+        continue;
+      }
+      case PcapngFile::kEnhancedPacketBlock: {
+        PcapngFile::EnhancedPacket header;
+        header_length = sizeof(header);
+        if (body_length < header_length) {
+          break;
+        }
+        std::memcpy(&header, body, header_length);
+        interface_id = header.interface_id;
+        timestamp_high = header.timestamp_high;
+        timestamp_low = header.timestamp_low;
+        captured_length = header.captured_length;
+        original_length = header.original_length;
+        break;
+      }
+      case PcapngFile::kPacketBlock: {
+        PcapngFile::ObsoletePacket header;
+        header_length = sizeof(header);
+        if (body_length < header_length) {
+          break;
+        }
+        std::memcpy(&header, body, header_length);
+        interface_id = header.interface_id;
+        timestamp_high = header.timestamp_high;
+        timestamp_low = header.timestamp_low;
+        captured_length = header.captured_length;
+        original_length = header.original_length;
+        break;
+      }
+      case PcapngFile::kSimplePacketBlock: {
+        PcapngFile::SimplePacket header;
+        header_length = sizeof(header);
+        if (body_length < header_length || cursor.interfaces.empty()) {
+          break;
+        }
+        std::memcpy(&header, body, header_length);
+        // The captured length is implied by the snap length of interface 0
+        original_length = header.original_length;
+        uint32_t snap_length = cursor.interfaces[0].snap_length;
+        captured_length = (snap_length != 0 && snap_length < original_length)
+                          ? snap_length : original_length;
+        break;
+      }
+      default:
+        // Statistics, name resolution and other blocks are not needed
+        continue;
+    }
+
+    if (body_length < header_length ||
+        interface_id >= cursor.interfaces.size() ||
+        captured_length > body_length - header_length) {
+      throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                               "Packet " + std::to_string(cursor.index) +
+                               " is corrupt.");
+    }
+    if (captured_length != original_length) {
+      throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                               "Packet " + std::to_string(cursor.index) +
+                               " was truncated. Comparing PCAPs with truncated"
+                               " data captures is not supported.");
+    }
+
+    if (block.block_type == PcapngFile::kSimplePacketBlock) {
+      // Keep the file in time order by reusing the previous timestamp
+      packet.time = cursor.last_time;
+    } else {
+      packet.time = cursor.interfaces[interface_id].GetTimestamp(
+          timestamp_high, timestamp_low);
     }
+    packet.length = captured_length;
+    packet.data = body + header_length;
+    cursor.last_time = packet.time;
+    cursor.index++;
+    return true;
   }
+  return false;
+}
 
-  // If we didn't limit the number of packets, then the packet_ptr
-  // should be at the end of the file. If it isn't then something went wrong.
-  if (max_packets == 0 && packet_ptr != end_ptr) {
+const uint8_t* PcapReader::NextBlock(size_t& offset,
+                                     PcapngFile::BlockHeader& block) const {
+  size_t header_end = offset + sizeof(PcapngFile::BlockHeader);
+  size_t size = Available(header_end);
+  if (size == offset) {
+    return nullptr;
+  }
+  // The trailing copy of the block length is not checked, to avoid touching
+  // the end of every packet while indexing the file.
+  if (size < header_end) {
     throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
                              "File appears truncated or corrupt.");
   }
-
-  if (packets.size() == 0) {
+  std::memcpy(&block, GetData(offset, sizeof(PcapngFile::BlockHeader)),
+              sizeof(PcapngFile::BlockHeader));
+  // The block type of a section header reads the same in either byte
+  // order, but its length doesn't, so the byte order is checked first
+  if (block.block_type == PcapngFile::kSectionHeaderBlock &&
+      Available(header_end + sizeof(uint32_t)) - header_end >=
+          sizeof(uint32_t)) {
+    uint32_t byte_order_magic;
+    std::memcpy(&byte_order_magic, GetData(header_end, sizeof(uint32_t)),
+                sizeof(uint32_t));
+    if (byte_order_magic == 0x4D3C2B1A) {
+      throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                               "PCAP file uses a different endian to this "
+                               "processor. Only PCAPs with the same endian "
+                               "to the processor running the program are "
+                               "supported.");
+    }
+  }
+  if (block.block_total_length < 12 || block.block_total_length % 4 != 0 ||
+      Available(offset + block.block_total_length) - offset <
+          block.block_total_length) {
     throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
-      "File contains no packets.");
+                             "File appears truncated or corrupt.");
   }
+  const uint8_t* body = GetData(offset, block.block_total_length) +
+                        sizeof(PcapngFile::BlockHeader);
+  offset += block.block_total_length;
+  return body;
+}
 
-  // Named return value optimisation will stop this being a copy operation
-  return packets;
+void PcapReader::ParseSectionHeader(const uint8_t* body,
+                                    size_t body_length) const {
+  PcapngFile::SectionHeader header;
+  if (body_length < sizeof(PcapngFile::SectionHeader)) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                             "File is not a PCAP file.");
+  }
+  std::memcpy(&header, body, sizeof(PcapngFile::SectionHeader));
+  // A swapped byte order has already been rejected by NextBlock
+  if (header.byte_order_magic != PcapngFile::kByteOrderMagic) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                              "File is not a PCAP file.");
+  }
+  if (header.major_version != 1) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n"
+                              "pcapng file version " +
+                              std::to_string(header.major_version) + "." +
+                              std::to_string(header.minor_version) + " "
+                              "is not supported. "
+                              "Only version 1.x is supported");
+  }
 }
 
 uint32_t PcapReader::GetLinkLayer() const {
-  return Header_.link_type;
+  return link_layer_;
+}
+
+bool PcapReader::IsNanosecond() const {
+  return nanosecond_;
+}
+
+bool PcapReader::IsStreamed() const {
+  return stream_ != nullptr;
+}
+
+std::shared_ptr<const MappedFile> PcapReader::GetFile() const {
+  return pcap_file_;
+}
+
+bool PcapReader::FindOffset(const uint8_t* data, size_t& offset) const {
+  if (stream_) {
+    return stream_->FindOffset(data, offset);
+  }
+  if (data < pcap_file_->Data() ||
+      data > pcap_file_->Data() + pcap_file_->Size()) {
+    return false;
+  }
+  offset = data - pcap_file_->Data();
+  return true;
+}
+
+size_t PcapReader::Release(size_t offset, size_t length) const {
+  if (stream_) {
+    stream_->Release(offset + length);
+    return offset + length;
+  }
+  return pcap_file_->Release(offset, length);
+}
+
+size_t PcapReader::Available(size_t end) const {
+  if (!stream_) {
+    return pcap_file_->Size();
+  }
+  try {
+    return stream_->WaitFor(end);
+  } catch (const std::runtime_error& error) {
+    throw std::runtime_error("Failed to parse file: " + filename_ + "\n" +
+                             error.what());
+  }
+}
+
+const uint8_t* PcapReader::GetData(size_t offset, size_t length) const {
+  if (!stream_) {
+    return pcap_file_->Data() + offset;
+  }
+  return stream_->Get(offset, length);
+}
+
+const std::string& PcapReader::GetFilename() const {
+  return filename_;
 }
\ No newline at end of file
@@ -35,9 +35,9 @@ void PcapWriter::WritePcapMatched(const std::string& filename,
                                   const Packets& packets, bool matched) {
   
   size_t total_bytes = sizeof(PcapFile::FileHeader);
-  for (const Packet& packet : packets) {
-    if (packet.match == matched) {
-      total_bytes += packet.data.size();
+  for (size_t i = 0; i < packets.Size(); ++i) {
+    if (packets.IsMatched(i) == matched) {
+      total_bytes += packets[i].Size();
       total_bytes += sizeof(PcapFile::PacketHeader);
     }
   }
@@ -46,18 +46,16 @@ void PcapWriter::WritePcapMatched(const std::string& filename,
   uint8_t* data = output_file.DataWritable();
 
   // Copy over the PCAP global file header
+  bool nanosecond = packets.IsNanosecond();
   PcapFile::FileHeader file_header = \
-      PcapFile::GetStandardHeader(packets.GetLinkLayer());
+      PcapFile::GetStandardHeader(packets.GetLinkLayer(), nanosecond);
   std::memcpy(data, &file_header, sizeof(PcapFile::FileHeader));
   data += sizeof(PcapFile::FileHeader);
 
   // Write the rest of the data
-  for (const auto& packet : packets) {
-    if (packet.match == matched) {
-      std::memcpy(data, &packet.header, sizeof(PcapFile::PacketHeader));
-      data += sizeof(PcapFile::PacketHeader);
-      std::memcpy(data, packet.data.data(), packet.data.size());
-      data += packet.data.size();
+  for (size_t i = 0; i < packets.Size(); ++i) {
+    if (packets.IsMatched(i) == matched) {
+      data = WritePacket(data, packets[i], nanosecond);
     }
   }
 
@@ -70,16 +68,16 @@ void PcapWriter::WritePcapBasic(const std::string& filename,
   // Calculate the exact size that the generated will be
   size_t total_bytes = sizeof(PcapFile::FileHeader);
   // Matched and unmatched (removed) packets in file A
-  for (const Packet& packet : packets_a) {
-    total_bytes += packet.data.size();
+  for (size_t i = 0; i < packets_a.Size(); ++i) {
+    total_bytes += packets_a[i].Size();
     total_bytes += sizeof(PcapFile::PacketHeader);
     // Extra byte for diff output
     total_bytes++;
   }
   // Just unmatched (added) packets in file B
-  for (const Packet& packet : packets_b) {
-    if (!packet.match) {
-      total_bytes += packet.data.size();
+  for (size_t i = 0; i < packets_b.Size(); ++i) {
+    if (!packets_b.IsMatched(i)) {
+      total_bytes += packets_b[i].Size();
       total_bytes += sizeof(PcapFile::PacketHeader);
       // Extra byte for diff output
       total_bytes++;
@@ -99,78 +97,66 @@ void PcapWriter::WritePcapBasic(const std::string& filename,
   }
 
   // Copy over the PCAP global file header
+  // Timestamps are only written in nanoseconds if needed, so microsecond
+  // inputs still produce a microsecond output file.
+  bool nanosecond = packets_a.IsNanosecond() || packets_b.IsNanosecond();
   PcapFile::FileHeader file_header = \
-      PcapFile::GetStandardHeader(packets_a.GetLinkLayer());
+      PcapFile::GetStandardHeader(packets_a.GetLinkLayer(), nanosecond);
   std::memcpy(data, &file_header, sizeof(PcapFile::FileHeader));
   data += sizeof(PcapFile::FileHeader);
 
   // Add the packet data to the file
   size_t count_a = 0;
   size_t count_b = 0;
+  const std::vector<Timestamp>& times_a = packets_a.GetTimes();
+  const std::vector<Timestamp>& times_b = packets_b.GetTimes();
 
   // First loop through packets until at least one of packets_a or packets_b
   // is finished.
   while (count_a < packets_a.Size() && count_b < packets_b.Size()) {
     // Skip through B until there is an unmatched (added) packet
-    if (packets_b[count_b].match) {
+    if (packets_b.IsMatched(count_b)) {
       count_b++;
       continue;
     }
     // Output packets from A until the right slot for the unmatched 
     // packet from B.
-    if (packets_a[count_a].header.time < packets_b[count_b].header.time) {
-      CopyHeaderIncLen(data, packets_a[count_a].header);
-      data += sizeof(PcapFile::PacketHeader);
-      std::memcpy(data, packets_a[count_a].data.data(), 
-                  packets_a[count_a].data.size());
+    if (times_a[count_a] < times_b[count_b]) {
       // Set last byte of packet to 0 if packet matches or 1
       // if it doesn't (i.e. it is not present in file B).
-      data += packets_a[count_a].data.size();
-      *data = packets_a[count_a].match ? 0 : 1;
-      data++;
+      data = WritePacketBasicFormat(data, packets_a[count_a], nanosecond,
+                                    packets_a.IsMatched(count_a) ? 0 : 1);
       count_a++;
     } else {
-      CopyHeaderIncLen(data, packets_b[count_b].header);
-      data += sizeof(PcapFile::PacketHeader);
-      std::memcpy(data, packets_b[count_b].data.data(), 
-              packets_b[count_b].data.size());
-      data += packets_b[count_b].data.size();
       // Set last byte of packet to 2 to indicate
       // that packet was added.
-      *data = 2;
-      data++;
+      data = WritePacketBasicFormat(data, packets_b[count_b], nanosecond, 2);
       count_b++;
     }
   }
   // Next loop through any remaining packets in A
   while (count_a < packets_a.Size()) {
-    CopyHeaderIncLen(data, packets_a[count_a].header);
-    data += sizeof(PcapFile::PacketHeader);
-    std::memcpy(data, packets_a[count_a].data.data(), 
-                packets_a[count_a].data.size());
-    data += packets_a[count_a].data.size();
-    *data = packets_a[count_a].match ? 0 : 1;
-    data++;
+    data = WritePacketBasicFormat(data, packets_a[count_a], nanosecond,
+                                  packets_a.IsMatched(count_a) ? 0 : 1);
     count_a++;
   }
-  // Finally loop through any remaining packets in B
+  // Finally loop through any remaining unmatched (added) packets in B
   while (count_b < packets_b.Size()) {
-    CopyHeaderIncLen(data, packets_b[count_b].header);
-    data += sizeof(PcapFile::PacketHeader);
-    std::memcpy(data, packets_b[count_b].data.data(), 
-            packets_b[count_b].data.size());
-    data += packets_b[count_b].data.size();
-    *data = 2;
-    data++;
+    if (!packets_b.IsMatched(count_b)) {
+      data = WritePacketBasicFormat(data, packets_b[count_b], nanosecond, 2);
+    }
     count_b++;
   }
 }
 
-void PcapWriter::CopyHeaderIncLen(uint8_t* data, 
-                                  PcapFile::PacketHeader header,
-                                  uint32_t inc) {
-  header.incl_len += inc;
-  header.orig_len += inc;
+void PcapWriter::CopyHeaderIncLen(uint8_t* data, const Packet& packet,
+                                  bool nanosecond, uint32_t inc) {
+  PcapFile::PacketHeader header{
+    packet.time.Seconds(),
+    nanosecond ? packet.time.Nanoseconds() : packet.time.Microseconds(),
+    packet.length + inc,
+    packet.length + inc
+  };
   std::memcpy(data, &header, sizeof(PcapFile::PacketHeader));
 }
 
@@ -181,12 +167,12 @@ void PcapWriter::WritePcapFull(const std::string& filename,
   // Calculate the exact size that the generated will be
   size_t total_bytes = sizeof(PcapFile::FileHeader);
   // Matched and unmatched (removed) packets in file A
-  for (const Packet& packet : packets_a) {
-    if (packet.match) {
+  for (size_t i = 0; i < packets_a.Size(); ++i) {
+    if (packets_a.IsMatched(i)) {
       // For matched packets the packet from file A AND from file B is included
-      total_bytes += packet.data.size();
+      total_bytes += packets_a[i].Size();
       total_bytes += sizeof(PcapFile::PacketHeader);
-      total_bytes += packet.match_packet->data.size();
+      total_bytes += packets_b[packets_a.GetMatch(i)].Size();
       // Diff header for matched packets is 21 bytes long:
       // 1 byte match field, 4 bytes file A link type, 4 bytes packet A
       // length, 4 bytes file B link type, 8 bytes B timestamp = 21 bytes
@@ -194,7 +180,7 @@ void PcapWriter::WritePcapFull(const std::string& filename,
       // overall PCAP packet length.
       total_bytes += 21;
     } else {
-      total_bytes += packet.data.size();
+      total_bytes += packets_a[i].Size();
       total_bytes += sizeof(PcapFile::PacketHeader);      
       // Diff header for removed packets is 5 bytes long:
       // 1 byte match field, 4 bytes File A link type
@@ -202,9 +188,9 @@ void PcapWriter::WritePcapFull(const std::string& filename,
     }
   }
   // Just unmatched (added) packets in file B
-  for (const Packet& packet : packets_b) {
-    if (!packet.match) {
-      total_bytes += packet.data.size();
+  for (size_t i = 0; i < packets_b.Size(); ++i) {
+    if (!packets_b.IsMatched(i)) {
+      total_bytes += packets_b[i].Size();
       total_bytes += sizeof(PcapFile::PacketHeader);
       // Diff header for added packets is 5 bytes long:
       // 1 byte match field, 4 bytes File B link type
@@ -216,68 +202,94 @@ void PcapWriter::WritePcapFull(const std::string& filename,
   uint8_t* data = output_file.DataWritable();
 
   // Copy over the PCAP global file header with Link type set to 147 (DLT_USER0)
+  bool nanosecond = packets_a.IsNanosecond() || packets_b.IsNanosecond();
   PcapFile::FileHeader file_header = \
-      PcapFile::GetStandardHeader(147);
+      PcapFile::GetStandardHeader(147, nanosecond);
   std::memcpy(data, &file_header, sizeof(PcapFile::FileHeader));
   data += sizeof(PcapFile::FileHeader);
 
   // Add the packet data to the file
   size_t count_a = 0;
   size_t count_b = 0;
+  const std::vector<Timestamp>& times_a = packets_a.GetTimes();
+  const std::vector<Timestamp>& times_b = packets_b.GetTimes();
+
+  // Packets from A are either matched (written with their match from B)
+  // or removed.
+  auto write_packet_a = [&](size_t index) {
+    if (packets_a.IsMatched(index)) {
+      return WritePacketFullFormatMatch(
+          data, packets_a[index], packets_b[packets_a.GetMatch(index)],
+          nanosecond, packets_a.GetLinkLayer(), packets_b.GetLinkLayer());
+    }
+    return WritePacketFullFormat(data, packets_a[index], nanosecond,
+                                 packets_a.GetLinkLayer(), false);
+  };
 
   // First loop through packets until at least one of packets_a or packets_b
   // is finished.
   while (count_a < packets_a.Size() && count_b < packets_b.Size()) {
     // Skip through B until there is an unmatched (added) packet
-    if (packets_b[count_b].match) {
+    if (packets_b.IsMatched(count_b)) {
       count_b++;
       continue;
     }
     // Output packets from A until the right slot for the unmatched 
     // packet from B.
-    if (packets_a[count_a].header.time < packets_b[count_b].header.time) {
-      // PCAP Header
-      if (packets_a[count_a].match) {
-        data = WritePacketFullFormatMatch(data, packets_a[count_a],
-                                          packets_a.GetLinkLayer(),
-                                          packets_b.GetLinkLayer());
-      } else {
-        data = WritePacketFullFormat(data, packets_a[count_a],
-                                     packets_a.GetLinkLayer(), false);
-      }
+    if (times_a[count_a] < times_b[count_b]) {
+      data = write_packet_a(count_a);
       count_a++;
     } else {
-      data = WritePacketFullFormat(data, packets_b[count_b],
+      data = WritePacketFullFormat(data, packets_b[count_b], nanosecond,
                                    packets_b.GetLinkLayer(), true);
       count_b++;
     }
   }
   // Next loop through any remaining packets in A
   while (count_a < packets_a.Size()) {
-    if (packets_a[count_a].match) {
-      data = WritePacketFullFormatMatch(data, packets_a[count_a],
-                                        packets_a.GetLinkLayer(),
-                                        packets_b.GetLinkLayer());
-    } else {
-      data = WritePacketFullFormat(data, packets_a[count_a],
-                                   packets_a.GetLinkLayer(), false);
-    }
+    data = write_packet_a(count_a);
     count_a++;
   }
-  // Finally loop through any remaining packets in B
+  // Finally loop through any remaining unmatched (added) packets in B
   while (count_b < packets_b.Size()) {
-    // Packets in B but not in A
-    data = WritePacketFullFormat(data, packets_b[count_b],
-                                 packets_b.GetLinkLayer(), true);
+    if (!packets_b.IsMatched(count_b)) {
+      // Packets in B but not in A
+      data = WritePacketFullFormat(data, packets_b[count_b], nanosecond,
+                                   packets_b.GetLinkLayer(), true);
+    }
     count_b++;
   }
 
 }
 
+uint8_t* PcapWriter::WritePacket(uint8_t* file_ptr, const Packet& packet,
+                                 bool nanosecond) {
+  CopyHeaderIncLen(file_ptr, packet, nanosecond, 0);
+  file_ptr += sizeof(PcapFile::PacketHeader);
+  std::memcpy(file_ptr, packet.data, packet.Size());
+  file_ptr += packet.Size();
+  return file_ptr;
+}
+
+uint8_t* PcapWriter::WritePacketBasicFormat(
+    uint8_t* file_ptr, const Packet& packet, bool nanosecond,
+    uint8_t diff_byte) {
+
+  CopyHeaderIncLen(file_ptr, packet, nanosecond);
+  file_ptr += sizeof(PcapFile::PacketHeader);
+  std::memcpy(file_ptr, packet.data, packet.Size());
+  file_ptr += packet.Size();
+  // Extra byte at the end of the packet: 0 matched, 1 removed, 2 added
+  *file_ptr = diff_byte;
+  file_ptr++;
+  return file_ptr;
+}
+
 uint8_t* PcapWriter::WritePacketFullFormat(
-    uint8_t* file_ptr, const Packet& packet, uint32_t link_layer, bool added) {
+    uint8_t* file_ptr, const Packet& packet, bool nanosecond,
+    uint32_t link_layer, bool added) {
 
-  CopyHeaderIncLen(file_ptr, packet.header, 5);
+  CopyHeaderIncLen(file_ptr, packet, nanosecond, 5);
   file_ptr += sizeof(PcapFile::PacketHeader);
   // Diff Header (1 byte Match field, 4 bytes PCAP Link type)
   *file_ptr = added ? 2 : 1;
@@ -285,16 +297,16 @@ uint8_t* PcapWriter::WritePacketFullFormat(
   std::memcpy(file_ptr, &link_layer, sizeof(uint32_t));
   file_ptr += 4;
   // Packet data
-  std::memcpy(file_ptr, packet.data.data(), packet.data.size());
-  file_ptr += packet.data.size();
+  std::memcpy(file_ptr, packet.data, packet.Size());
+  file_ptr += packet.Size();
   return file_ptr;
 }
 
 uint8_t* PcapWriter::WritePacketFullFormatMatch(
-    uint8_t* file_ptr, const Packet& packet,
-    uint32_t link_layer_a, uint32_t link_layer_b) {
+    uint8_t* file_ptr, const Packet& packet, const Packet& match_packet,
+    bool nanosecond, uint32_t link_layer_a, uint32_t link_layer_b) {
 
-  CopyHeaderIncLen(file_ptr, packet.header, 21 + packet.match_packet->data.size());
+  CopyHeaderIncLen(file_ptr, packet, nanosecond, 21 + match_packet.Size());
   file_ptr += sizeof(PcapFile::PacketHeader);
   // Diff Header - 21 bytes:
   // 1 byte match field, 4 bytes link type A, 4 bytes length A, <Packet A>. 
@@ -304,21 +316,24 @@ uint8_t* PcapWriter::WritePacketFullFormatMatch(
   // Packet A (Link type, then length, then the packet)
   std::memcpy(file_ptr, &link_layer_a, sizeof(uint32_t));
   file_ptr += 4;
-  uint32_t packet_size = packet.data.size();
+  uint32_t packet_size = packet.Size();
   std::memcpy(file_ptr, &packet_size, sizeof(uint32_t));
   file_ptr += 4;
-  std::memcpy(file_ptr, packet.data.data(), packet.data.size());
-  file_ptr += packet.data.size();
+  std::memcpy(file_ptr, packet.data, packet.Size());
+  file_ptr += packet.Size();
   // Packet B (Link type, then timestamp, then the packet)
   std::memcpy(file_ptr, &link_layer_b, sizeof(uint32_t));
   file_ptr += 4;
-  std::memcpy(file_ptr, &packet.match_packet->header.time.ts_sec, sizeof(uint32_t));
+  // Timestamp B is always in microseconds, as expected by the diff
+  // protocol dissector, whatever the resolution of the output file.
+  uint32_t ts_sec = match_packet.time.Seconds();
+  uint32_t ts_usec = match_packet.time.Microseconds();
+  std::memcpy(file_ptr, &ts_sec, sizeof(uint32_t));
   file_ptr += 4;
-  std::memcpy(file_ptr, &packet.match_packet->header.time.ts_usec, sizeof(uint32_t));
+  std::memcpy(file_ptr, &ts_usec, sizeof(uint32_t));
   file_ptr += 4;
-  std::memcpy(file_ptr, packet.match_packet->data.data(),
-              packet.match_packet->data.size());
-  file_ptr += packet.match_packet->data.size();
+  std::memcpy(file_ptr, match_packet.data, match_packet.Size());
+  file_ptr += match_packet.Size();
 
   return file_ptr;
 }
@@ -342,3 +357,138 @@ PcapWriter::Mode PcapWriter::StringToMode(const std::string& mode) {
   return PcapWriter::Mode::Basic;
 }
 
+
+PcapWriter::StreamWriter::StreamWriter(const std::string& filename,
+                                       const std::string& mode,
+                                       uint32_t link_layer_a,
+                                       uint32_t link_layer_b,
+                                       bool nanosecond_a,
+                                       bool nanosecond_b)
+    : mode_(StringToMode(mode)),
+      link_layer_a_(link_layer_a),
+      link_layer_b_(link_layer_b),
+      nanosecond_(nanosecond_a || nanosecond_b),
+      filename_(filename),
+      file_(filename, std::ios::binary | std::ios::trunc),
+      buffer_(1 << 20),
+      buffer_used_(0) {
+
+  if (!file_) {
+    throw std::runtime_error("Failed to open file: " + filename);
+  }
+
+  // Same link layer and timestamp resolution as PcapWriter::WritePcap
+  uint32_t link_layer = link_layer_a;
+  if (mode_ == Mode::MatchA || mode_ == Mode::Removed) {
+    nanosecond_ = nanosecond_a;
+  } else if (mode_ == Mode::MatchB || mode_ == Mode::Added) {
+    link_layer = link_layer_b;
+    nanosecond_ = nanosecond_b;
+  } else if (mode_ == Mode::Full) {
+    // DLT_USER0
+    link_layer = 147;
+  } else if (mode_ == Mode::Basic && link_layer_a != link_layer_b) {
+    throw std::runtime_error("Link layer of Packets A and B differs. "
+                             "The 'basic' output format requires that "
+                             "they match.");
+  }
+
+  PcapFile::FileHeader file_header = PcapFile::GetStandardHeader(link_layer,
+                                                                 nanosecond_);
+  std::memcpy(Reserve(sizeof(PcapFile::FileHeader)), &file_header,
+              sizeof(PcapFile::FileHeader));
+}
+
+void PcapWriter::StreamWriter::WriteA(const Packet& packet,
+                                      const Packet* match_packet) {
+  bool matched = match_packet != nullptr;
+  switch (mode_) {
+    case Mode::MatchA:
+    case Mode::Removed:
+      if (matched == (mode_ == Mode::MatchA)) {
+        WritePacket(Reserve(sizeof(PcapFile::PacketHeader) + packet.Size()),
+                    packet, nanosecond_);
+      }
+      break;
+    case Mode::Basic:
+      // Last byte is 0 if the packet matches or 1 if it was removed
+      WritePacketBasicFormat(
+          Reserve(sizeof(PcapFile::PacketHeader) + packet.Size() + 1),
+          packet, nanosecond_, matched ? 0 : 1);
+      break;
+    case Mode::Full:
+      if (matched) {
+        WritePacketFullFormatMatch(
+            Reserve(sizeof(PcapFile::PacketHeader) + 21 + packet.Size() +
+                    match_packet->Size()),
+            packet, *match_packet, nanosecond_, link_layer_a_, link_layer_b_);
+      } else {
+        WritePacketFullFormat(
+            Reserve(sizeof(PcapFile::PacketHeader) + 5 + packet.Size()),
+            packet, nanosecond_, link_layer_a_, false);
+      }
+      break;
+    case Mode::MatchB:
+    case Mode::Added:
+      break;
+  }
+}
+
+void PcapWriter::StreamWriter::WriteB(const Packet& packet, bool matched) {
+  switch (mode_) {
+    case Mode::MatchB:
+    case Mode::Added:
+      if (matched == (mode_ == Mode::MatchB)) {
+        WritePacket(Reserve(sizeof(PcapFile::PacketHeader) + packet.Size()),
+                    packet, nanosecond_);
+      }
+      break;
+    case Mode::Basic:
+      // Matched packets from B are represented by the packet from A
+      if (!matched) {
+        WritePacketBasicFormat(
+            Reserve(sizeof(PcapFile::PacketHeader) + packet.Size() + 1),
+            packet, nanosecond_, 2);
+      }
+      break;
+    case Mode::Full:
+      if (!matched) {
+        WritePacketFullFormat(
+            Reserve(sizeof(PcapFile::PacketHeader) + 5 + packet.Size()),
+            packet, nanosecond_, link_layer_b_, true);
+      }
+      break;
+    case Mode::MatchA:
+    case Mode::Removed:
+      break;
+  }
+}
+
+void PcapWriter::StreamWriter::Close() {
+  Flush();
+  file_.close();
+  if (!file_) {
+    throw std::runtime_error("Failed to write file: " + filename_);
+  }
+}
+
+uint8_t* PcapWriter::StreamWriter::Reserve(size_t num_bytes) {
+  if (buffer_used_ + num_bytes > buffer_.size()) {
+    Flush();
+    // Jumbo packets may not fit in the default buffer
+    if (num_bytes > buffer_.size()) {
+      buffer_.resize(num_bytes);
+    }
+  }
+  uint8_t* data = buffer_.data() + buffer_used_;
+  buffer_used_ += num_bytes;
+  return data;
+}
+
+void PcapWriter::StreamWriter::Flush() {
+  file_.write(reinterpret_cast<const char*>(buffer_.data()), buffer_used_);
+  if (!file_) {
+    throw std::runtime_error("Failed to write file: " + filename_);
+  }
+  buffer_used_ = 0;
+}
@@ -0,0 +1,100 @@
+#include <cstring>
+
+#include <pcapng_file.h>
+
+namespace {
+  // Interface Description Block options
+  constexpr uint16_t kOptionEnd = 0;
+  constexpr uint16_t kOptionTsResolution = 9;
+  constexpr uint16_t kOptionTsOffset = 14;
+
+  constexpr uint64_t kNanosecondsPerSecond = 1000000000;
+}
+
+Timestamp PcapngFile::Interface::GetTimestamp(uint32_t timestamp_high,
+                                              uint32_t timestamp_low) const {
+  uint64_t units = (uint64_t(timestamp_high) << 32) | timestamp_low;
+  uint64_t ns;
+  if (binary_shift < 0) {
+    ns = units * multiplier / divisor;
+  } else {
+    uint64_t seconds = units >> binary_shift;
+    uint64_t fraction = units & ((uint64_t(1) << binary_shift) - 1);
+    // Drop fraction bits below 2^-30 so the multiply can't overflow
+    int shift = binary_shift;
+    if (shift > 30) {
+      fraction >>= shift - 30;
+      shift = 30;
+    }
+    ns = seconds * kNanosecondsPerSecond +
+         ((fraction * kNanosecondsPerSecond) >> shift);
+  }
+  return Timestamp::FromNanoseconds(static_cast<int64_t>(ns) + offset_ns);
+}
+
+bool PcapngFile::ParseInterface(const uint8_t* body, size_t body_length,
+                                Interface& interface) {
+  InterfaceDescription description;
+  if (body_length < sizeof(InterfaceDescription)) {
+    return false;
+  }
+  std::memcpy(&description, body, sizeof(InterfaceDescription));
+
+  interface.link_type = description.link_type;
+  interface.snap_length = description.snap_length;
+  uint8_t resolution = 6;
+  int64_t offset_seconds = 0;
+
+  // Options are a 2 byte code, 2 byte length, then the value padded to
+  // 4 bytes. They are optional and may run to the end of the block.
+  size_t offset = sizeof(InterfaceDescription);
+  while (offset + 4 <= body_length) {
+    uint16_t code;
+    uint16_t length;
+    std::memcpy(&code, body + offset, sizeof(uint16_t));
+    std::memcpy(&length, body + offset + 2, sizeof(uint16_t));
+    offset += 4;
+    if (code == kOptionEnd) {
+      break;
+    }
+    if (length > body_length - offset) {
+      return false;
+    }
+    if (code == kOptionTsResolution && length == 1) {
+      resolution = body[offset];
+    } else if (code == kOptionTsOffset && length == 8) {
+      std::memcpy(&offset_seconds, body + offset, sizeof(int64_t));
+    }
+    offset += (length + 3) & ~size_t(3);
+  }
+
+  interface.offset_ns = offset_seconds * int64_t(kNanosecondsPerSecond);
+  if (resolution & 0x80) {
+    // Units of 2^-n seconds
+    int shift = resolution & 0x7F;
+    if (shift > 63) {
+      return false;
+    }
+    interface.binary_shift = shift;
+    interface.multiplier = 1;
+    interface.divisor = 1;
+    // 2^-20 is the first binary resolution finer than a microsecond
+    interface.nanosecond = shift >= 20;
+  } else {
+    // Units of 10^-n seconds
+    if (resolution > 19) {
+      return false;
+    }
+    interface.binary_shift = -1;
+    interface.multiplier = 1;
+    interface.divisor = 1;
+    for (int i = resolution; i < 9; ++i) {
+      interface.multiplier *= 10;
+    }
+    for (int i = 9; i < resolution; ++i) {
+      interface.divisor *= 10;
+    }
+    interface.nanosecond = resolution > 6;
+  }
+  return true;
+}
@@ -0,0 +1,284 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include <stream_diff.h>
+
+namespace {
+  // Packets read between looking for data to release. Finding the oldest
+  // packet still held means walking the packets in the window.
+  constexpr size_t kReleasePackets = 16384;
+}
+
+StreamDiff::StreamDiff(const PacketDiff& packet_diff,
+                       const CaptureSet& reader_a,
+                       const CaptureSet& reader_b,
+                       uint64_t max_packets,
+                       double time_offset_a,
+                       double time_offset_b)
+    : packet_diff_(packet_diff),
+      reader_a_(reader_a),
+      reader_b_(reader_b),
+      max_packets_(max_packets),
+      time_offset_a_(time_offset_a),
+      time_offset_b_(time_offset_b),
+      cursor_a_(reader_a.Begin()),
+      cursor_b_(reader_b.Begin()),
+      done_b_(false),
+      window_start_b_(0),
+      drop_behind_(false),
+      released_a_(reader_a.NumFiles(), 0),
+      released_b_(reader_b.NumFiles(), 0),
+      next_release_(kReleasePackets),
+      writer_(nullptr),
+      num_matched_(0),
+      num_removed_(0),
+      num_added_(0) { }
+
+void StreamDiff::SetDropBehind(bool drop_behind) {
+  drop_behind_ = drop_behind;
+}
+
+void StreamDiff::Run(PcapWriter::StreamWriter* writer) {
+  writer_ = writer;
+  // Both inputs are read once from start to end
+  for (const CaptureSet* reader : {&reader_a_, &reader_b_}) {
+    for (size_t i = 0; i < reader->NumFiles(); ++i) {
+      if (reader->GetReader(i).GetFile()) {
+        reader->GetReader(i).GetFile()->Advise(
+            MappedFile::Access::Sequential);
+      }
+    }
+  }
+  const std::pair<Timestamp, Timestamp>& time_range = \
+      packet_diff_.GetTimeRange();
+
+  Packet packet_a;
+  if (!ReadA(packet_a)) {
+    throw std::runtime_error("Failed to parse File A.\n"
+                             "File contains no packets.");
+  }
+  if (!ReadB()) {
+    throw std::runtime_error("Failed to parse File B.\n"
+                             "File contains no packets.");
+  }
+
+  do {
+    Timestamp window_start = packet_a.time - time_range.first;
+    Timestamp window_end = packet_a.time + time_range.second;
+    if (packet_diff_.IsTrackingDrift()) {
+      // Packets before the current window may have been written, so the
+      // window can only move forward
+      Timestamp drift = drift_tracker_.Predict(packet_a.time);
+      window_start += drift;
+      window_end += drift;
+    }
+
+    // Move the window start to the first packet in B within the time window.
+    // Packets before it will never be searched again.
+    while (window_start_b_ < packets_b_.size() || ReadB()) {
+      if (!(packets_b_[window_start_b_].packet.time < window_start)) {
+        break;
+      }
+      window_start_b_++;
+    }
+
+    // Read B until the first packet after the end of the time window
+    while ((packets_b_.empty() ||
+            packets_b_.back().packet.time <= window_end) && ReadB()) { }
+
+    packets_a_.push_back(PacketA{packet_a, packet_diff_.HashPacketA(packet_a),
+                                 false, Packet()});
+    PacketA& pending = packets_a_.back();
+
+    // Check for matching entries within the time window
+    for (size_t index_b = window_start_b_; index_b < packets_b_.size() &&
+         packets_b_[index_b].packet.time <= window_end; ++index_b) {
+
+      PacketB& packet_b = packets_b_[index_b];
+      if (!packet_b.matched && packet_b.hash == pending.hash &&
+          packet_diff_.ComparePacket(pending.packet, packet_b.packet)) {
+        pending.matched = true;
+        pending.match_packet = packet_b.packet;
+        if (packet_diff_.IsTrackingDrift()) {
+          drift_tracker_.AddMatch(pending.packet.time, packet_b.packet.time);
+        }
+        // Packet A may be written before packet B, so B does not point back
+        packet_b.matched = true;
+        break;
+      }
+    }
+
+    WritePackets(false);
+    ReleaseConsumed();
+  } while (ReadA(packet_a));
+
+  // No more packets in A, so all remaining packets in B are unmatched
+  do {
+    WritePackets(true);
+    ReleaseConsumed();
+  } while (ReadB());
+}
+
+size_t StreamDiff::NumMatched() const {
+  return num_matched_;
+}
+
+size_t StreamDiff::NumRemoved() const {
+  return num_removed_;
+}
+
+size_t StreamDiff::NumAdded() const {
+  return num_added_;
+}
+
+const DriftTracker& StreamDiff::GetDriftTracker() const {
+  return drift_tracker_;
+}
+
+bool StreamDiff::ReadA(Packet& packet) {
+  if (max_packets_ != 0 && cursor_a_.index == max_packets_) {
+    return false;
+  }
+  if (!reader_a_.Next(cursor_a_, packet)) {
+    return false;
+  }
+  time_offset_a_.Apply(packet);
+  return true;
+}
+
+bool StreamDiff::ReadB() {
+  if (done_b_) {
+    return false;
+  }
+  Packet packet;
+  if ((max_packets_ != 0 && cursor_b_.index == max_packets_) ||
+      !reader_b_.Next(cursor_b_, packet)) {
+    done_b_ = true;
+    return false;
+  }
+  time_offset_b_.Apply(packet);
+  packets_b_.push_back(PacketB{packet, packet_diff_.HashPacketB(packet),
+                               false});
+  return true;
+}
+
+void StreamDiff::WriteA() {
+  const PacketA& packet = packets_a_.front();
+  if (writer_ != nullptr) {
+    writer_->WriteA(packet.packet,
+                    packet.matched ? &packet.match_packet : nullptr);
+  }
+  if (packet.matched) {
+    num_matched_++;
+  } else {
+    num_removed_++;
+  }
+  packets_a_.pop_front();
+}
+
+void StreamDiff::WriteB() {
+  const PacketB& packet = packets_b_.front();
+  if (writer_ != nullptr) {
+    writer_->WriteB(packet.packet, packet.matched);
+  }
+  if (!packet.matched) {
+    num_added_++;
+  }
+  packets_b_.pop_front();
+  if (window_start_b_ > 0) {
+    window_start_b_--;
+  }
+}
+
+void StreamDiff::WritePackets(bool finished) {
+  // Packets are written in the same order as PcapWriter::WritePcapBasic.
+  // Packets from A are interleaved with the unmatched packets from B.
+  while (true) {
+    if (packets_b_.empty()) {
+      if (packets_a_.empty()) {
+        break;
+      }
+      // The next packet in B is needed to know where the packet from A goes
+      if (!ReadB()) {
+        WriteA();
+      }
+      continue;
+    }
+
+    const PacketB& packet_b = packets_b_.front();
+    if (packet_b.matched) {
+      WriteB();
+    } else if (!packets_a_.empty() &&
+               packets_a_.front().packet.time <
+                   packet_b.packet.time) {
+      WriteA();
+    } else if (finished || window_start_b_ > 0) {
+      // Packet B is before the current time window, so it can't match
+      WriteB();
+    } else {
+      // Packet B could still match a later packet from A
+      break;
+    }
+  }
+}
+
+void StreamDiff::ReleaseConsumed() {
+  size_t num_read = cursor_a_.index + cursor_b_.index;
+  if (num_read < next_release_) {
+    return;
+  }
+  next_release_ = num_read + kReleasePackets;
+  // Packets from A hold a copy of their match from B
+  std::vector<const Packet*> held_a;
+  std::vector<const Packet*> held_b;
+  for (const PacketA& packet : packets_a_) {
+    held_a.push_back(&packet.packet);
+    if (packet.matched) {
+      held_b.push_back(&packet.match_packet);
+    }
+  }
+  for (const PacketB& packet : packets_b_) {
+    held_b.push_back(&packet.packet);
+  }
+  Release(reader_a_, cursor_a_, held_a, released_a_);
+  Release(reader_b_, cursor_b_, held_b, released_b_);
+}
+
+void StreamDiff::Release(const CaptureSet& reader,
+                         const CaptureSet::Cursor& cursor,
+                         const std::vector<const Packet*>& held,
+                         std::vector<size_t>& released) const {
+  // Everything in a file before the oldest packet still held from it has
+  // been written. The cursor also holds the next packet from each file.
+  std::vector<size_t> keep(reader.NumFiles());
+  for (size_t i = 0; i < reader.NumFiles(); ++i) {
+    keep[i] = cursor.cursors[i].offset;
+  }
+  auto hold = [&](const Packet& packet) {
+    size_t offset;
+    size_t file = reader.FindFile(packet.data, offset);
+    keep[file] = std::min(keep[file], offset);
+  };
+  for (const Packet* packet : held) {
+    hold(*packet);
+  }
+  for (size_t file : cursor.heap) {
+    hold(cursor.next[file]);
+  }
+  // Streamed input must always be released for its blocks to be reused.
+  // Mapped files are only dropped from memory if asked.
+  for (size_t i = 0; i < reader.NumFiles(); ++i) {
+    const PcapReader& file = reader.GetReader(i);
+    if (keep[i] > released[i] && (drop_behind_ || file.IsStreamed())) {
+      released[i] = file.Release(released[i], keep[i] - released[i]);
+    }
+  }
+}
+
+StreamDiff::TimeOffset::TimeOffset(double time_offset)
+    : offset(time_offset < 0.0 ? -Timestamp(-time_offset)
+                               : Timestamp(time_offset)) { }
+
+void StreamDiff::TimeOffset::Apply(Packet& packet) const {
+  packet.time += offset;
+}
@@ -0,0 +1,132 @@
+#include <atomic>
+#include <algorithm>
+
+#include <thread_pool.h>
+
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : stopping_(false) {
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // The thread calling ParallelFor also does work, so one fewer is needed
+  for (size_t i = 1; i < num_threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_ready_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+size_t ThreadPool::Size() const {
+  return workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(
+    size_t count, size_t min_chunk,
+    const std::function<void(size_t, size_t)>& function) {
+
+  if (count == 0) {
+    return;
+  }
+  // Several chunks per thread, so threads that finish early can help out
+  size_t chunk = std::max<size_t>(
+      std::max<size_t>(min_chunk, 1), count / (Size() * 8) + 1);
+  size_t num_chunks = (count + chunk - 1) / chunk;
+  if (num_chunks == 1 || workers_.empty()) {
+    function(0, count);
+    return;
+  }
+  RunChunks(num_chunks, [&](size_t index) {
+    size_t begin = index * chunk;
+    function(begin, std::min(begin + chunk, count));
+  });
+}
+
+void ThreadPool::ParallelForEach(
+    size_t count, const std::function<void(size_t)>& function) {
+
+  if (count <= 1 || workers_.empty()) {
+    for (size_t i = 0; i < count; ++i) {
+      function(i);
+    }
+    return;
+  }
+  RunChunks(count, function);
+}
+
+void ThreadPool::RunChunks(size_t num_chunks,
+                           const std::function<void(size_t)>& function) {
+  std::atomic<size_t> next_chunk(0);
+  std::mutex done_mutex;
+  std::condition_variable done;
+  size_t running = 0;
+  std::exception_ptr error;
+
+  // Each runner keeps taking chunks until there are none left
+  auto runner = [&]() {
+    size_t index;
+    while ((index = next_chunk.fetch_add(1)) < num_chunks) {
+      try {
+        function(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(done_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        // Skip any remaining chunks
+        next_chunk = num_chunks;
+      }
+    }
+  };
+
+  size_t num_helpers = std::min(workers_.size(), num_chunks - 1);
+  running = num_helpers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < num_helpers; ++i) {
+      tasks_.emplace_back([&]() {
+        runner();
+        std::lock_guard<std::mutex> lock(done_mutex);
+        if (--running == 0) {
+          done.notify_one();
+        }
+      });
+    }
+  }
+  task_ready_.notify_all();
+
+  runner();
+  std::unique_lock<std::mutex> lock(done_mutex);
+  done.wait(lock, [&]() { return running == 0; });
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_ready_.wait(lock, [this]() {
+        return stopping_ || !tasks_.empty();
+      });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
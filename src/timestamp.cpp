@@ -5,121 +5,142 @@
 #include <iomanip>
 #include <sstream>
 #include <limits>
+#include <cstdio>
+#include <cctype>
 
 #include <timestamp.h>
 
-Timestamp::Timestamp(uint32_t ts_sec, uint32_t ts_usec)
-    : ts_sec(ts_sec), ts_usec(ts_usec) {
-  if (ts_usec >= 1000000) {
-    throw std::runtime_error("Timestamp microseconds cannot be >= 1000000");
+namespace {
+  constexpr int64_t kNanosecondsPerSecond = 1000000000;
+
+  // Round towards negative infinity, so times before the epoch still have
+  // a fractional part in the range [0, 1) seconds.
+  int64_t FloorSeconds(int64_t ns) {
+    int64_t seconds = ns / kNanosecondsPerSecond;
+    if (ns % kNanosecondsPerSecond < 0) {
+      seconds--;
+    }
+    return seconds;
+  }
+
+  // Parse the digits after a decimal point as nanoseconds
+  bool ParseFraction(const char* digits, int64_t& ns) {
+    ns = 0;
+    int64_t scale = kNanosecondsPerSecond;
+    for (; *digits != '\0'; ++digits) {
+      if (!std::isdigit(static_cast<unsigned char>(*digits))) {
+        return false;
+      }
+      scale /= 10;
+      ns += (*digits - '0') * scale;
+    }
+    return true;
   }
 }
 
+Timestamp::Timestamp()
+    : ns(0) { }
+
+Timestamp::Timestamp(uint32_t ts_sec, uint32_t ts_frac, bool nanosecond)
+    : ns(int64_t(ts_sec) * kNanosecondsPerSecond +
+         (nanosecond ? int64_t(ts_frac) : int64_t(ts_frac) * 1000)) { }
+
 Timestamp::Timestamp(double time) {
   if (time < 0.0) {
     throw std::runtime_error("Timestamp cannot be negative");
   }
 
-  double integer_seconds = 0.0;
-  double fractional_seconds = std::modf(time, &integer_seconds);
+  double nanoseconds = std::round(time * kNanosecondsPerSecond);
 
-  if (integer_seconds >= std::numeric_limits<uint32_t>::max()) {
+  if (nanoseconds >= static_cast<double>(std::numeric_limits<int64_t>::max())) {
     throw std::runtime_error("Timestamp value too large");
   }
 
-  // Floor to avoid ever rounding up to 1000000
-  double micro_seconds = std::floor(fractional_seconds * 1000000);
-
-  ts_sec = static_cast<uint32_t>(integer_seconds);
-  ts_usec = static_cast<uint32_t>(micro_seconds);
-
-}
-
-bool Timestamp::operator==(const Timestamp &other) const
-{
-  return ts_sec == other.ts_sec && ts_usec == other.ts_usec;
+  ns = static_cast<int64_t>(nanoseconds);
 }
 
-bool Timestamp::operator!=(const Timestamp& other) const {
-  return !(*this == other);
+uint32_t Timestamp::Seconds() const {
+  return static_cast<uint32_t>(FloorSeconds(ns));
 }
 
-bool Timestamp::operator<(const Timestamp& other) const {
-  return (ts_sec < other.ts_sec) ||
-         (ts_sec == other.ts_sec && ts_usec < other.ts_usec);
+uint32_t Timestamp::Microseconds() const {
+  return Nanoseconds() / 1000;
 }
 
-bool Timestamp::operator<=(const Timestamp& other) const {
-  return *this < other || *this == other;
+uint32_t Timestamp::Nanoseconds() const {
+  return static_cast<uint32_t>(ns - FloorSeconds(ns) * kNanosecondsPerSecond);
 }
 
-bool Timestamp::operator>(const Timestamp& other) const {
-  return other < *this;
-}
-
-bool Timestamp::operator>=(const Timestamp& other) const {
-  return !(*this < other);
+std::string Timestamp::PrintTime() const {
+  std::time_t t = static_cast<std::time_t>(FloorSeconds(ns));
+  std::tm* tm_ptr = std::localtime(&t);
+  std::ostringstream oss;
+  oss << std::put_time(tm_ptr, "%Y-%m-%d %H:%M:%S");
+  oss << '.' << std::setfill('0') << std::setw(3) << (Nanoseconds() / 1000000);
+  return oss.str();
 }
 
-Timestamp& Timestamp::operator+=(Timestamp rhs) {
-
-  ts_sec += rhs.ts_sec;
-  ts_usec += rhs.ts_usec;
-
-  if (ts_usec >= 1000000) {
-    ts_sec++;
-    ts_usec -= 1000000;
+Timestamp Timestamp::Parse(const std::string& time, Timestamp reference) {
+  std::tm tm{};
+  char fraction[32] = "";
+  int length = 0;
+  if (std::sscanf(time.c_str(), "%4d-%2d-%2d %2d:%2d:%2d%n.%31s",
+                  &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour,
+                  &tm.tm_min, &tm.tm_sec, &length, fraction) >= 6 ||
+      std::sscanf(time.c_str(), "%2d:%2d:%2d%n.%31s",
+                  &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &length,
+                  fraction) >= 3) {
+    bool has_date = time.find('-') != std::string::npos;
+    if (has_date) {
+      tm.tm_year -= 1900;
+      tm.tm_mon -= 1;
+    } else {
+      std::time_t t = static_cast<std::time_t>(FloorSeconds(reference.ns));
+      std::tm* day = std::localtime(&t);
+      tm.tm_year = day->tm_year;
+      tm.tm_mon = day->tm_mon;
+      tm.tm_mday = day->tm_mday;
+    }
+    // Anything after the seconds must be a decimal fraction
+    int64_t fraction_ns = 0;
+    if (time.size() != static_cast<size_t>(length) &&
+        (time[length] != '.' || !ParseFraction(fraction, fraction_ns))) {
+      throw std::runtime_error("Invalid time: " + time);
+    }
+    tm.tm_isdst = -1;
+    std::time_t seconds = std::mktime(&tm);
+    if (seconds == static_cast<std::time_t>(-1)) {
+      throw std::runtime_error("Invalid time: " + time);
+    }
+    return FromNanoseconds(int64_t(seconds) * kNanosecondsPerSecond +
+                           fraction_ns);
   }
 
-  return *this;
-}
-
-Timestamp& Timestamp::operator-=(Timestamp rhs) {
-  // Invalid when rhs is greater than this timestamp
-  // We could check for this, but this would be wasteful 
-  // in this application
-  ts_sec -= rhs.ts_sec;
-  ts_usec -= rhs.ts_usec;
-
-  // Detect wrap of usec
-  if (ts_usec >= 1000000) {
-    ts_sec--;
-    ts_usec += 1000000;
+  // Otherwise the time must be a number of seconds. Plain decimals are
+  // parsed exactly, as a double can't hold nanoseconds at current times.
+  size_t point = time.find('.');
+  std::string whole = time.substr(0, point);
+  int64_t fraction_ns = 0;
+  if (!whole.empty() && whole.size() <= 18 &&
+      whole.find_first_not_of("0123456789") == std::string::npos &&
+      (point == std::string::npos ||
+       ParseFraction(time.c_str() + point + 1, fraction_ns))) {
+    int64_t seconds = std::stoll(whole);
+    if (seconds > (std::numeric_limits<int64_t>::max() - fraction_ns) /
+                  kNanosecondsPerSecond) {
+      throw std::runtime_error("Timestamp value too large");
+    }
+    return FromNanoseconds(seconds * kNanosecondsPerSecond + fraction_ns);
   }
-
-  return *this;
-}
-
-Timestamp Timestamp::operator-(const Timestamp& other) {
-  uint32_t ts_sec_sum = this->ts_sec - other.ts_sec;
-  uint32_t ts_usec_sum = this->ts_usec - other.ts_usec;
-
-  // Detect wrap of usec
-  if (ts_usec_sum >= 1000000) {
-    ts_sec_sum--;
-    ts_usec_sum += 1000000;
+  size_t end = 0;
+  double seconds = 0.0;
+  try {
+    seconds = std::stod(time, &end);
+  } catch (const std::exception&) {
+    end = 0;
   }
-
-  return Timestamp{ts_sec_sum, ts_usec_sum};
-}
-
-Timestamp Timestamp::operator+(const Timestamp& other) {
-  uint32_t ts_sec_sum = this->ts_sec + other.ts_sec;
-  uint32_t ts_usec_sum = this->ts_usec + other.ts_usec;
-
-  if (ts_usec_sum >= 1000000) {
-    ts_sec_sum++;
-    ts_usec_sum -= 1000000;
+  if (end == 0 || end != time.size()) {
+    throw std::runtime_error("Invalid time: " + time);
   }
-
-  return Timestamp{ts_sec_sum, ts_usec_sum};
+  return Timestamp(seconds);
 }
-
-std::string Timestamp::PrintTime() const {
-  std::time_t t = static_cast<std::time_t>(ts_sec);
-  std::tm* tm_ptr = std::localtime(&t);
-  std::ostringstream oss;
-  oss << std::put_time(tm_ptr, "%Y-%m-%d %H:%M:%S");
-  oss << '.' << std::setfill('0') << std::setw(3) << (ts_usec / 1000);
-  return oss.str();
-}
\ No newline at end of file
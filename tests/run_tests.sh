@@ -0,0 +1,408 @@
+#!/bin/sh
+# Regression tests for pcap_diff. Usage: tests/run_tests.sh <pcap_diff>
+
+PCAP_DIFF=${1:-build/pcap_diff}
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+FAILED=0
+
+# write_pcap <file> <count> <size>: a little endian microsecond PCAP with
+# count Ethernet packets of size bytes, one per second, where every byte of
+# packet i is i
+write_pcap() {
+  size_hex=$(printf '\\%03o' "$3")
+  printf '\324\303\262\241\002\000\004\000\000\000\000\000\000\000\000\000'\
+'\377\377\000\000\001\000\000\000' > "$1"
+  i=0
+  while [ "$i" -lt "$2" ]; do
+    byte=$(printf '\\%03o' "$i")
+    printf "$byte\\000\\000\\000\\000\\000\\000\\000" >> "$1"
+    printf "$size_hex\\000\\000\\000$size_hex\\000\\000\\000" >> "$1"
+    j=0
+    while [ "$j" -lt "$3" ]; do
+      printf "$byte" >> "$1"
+      j=$((j + 1))
+    done
+    i=$((i + 1))
+  done
+}
+
+# append_le32 <value>: appends value to record as little endian printf
+# escapes
+append_le32() {
+  for shift in 0 8 16 24; do
+    byte=$((($1 >> shift) & 255))
+    record="$record\\$((byte / 64))$((byte / 8 % 8))$((byte % 8))"
+  done
+}
+
+# write_padded_pcap <file> <count>: a PCAP with count packets, 100 a
+# second from time 1000, whose payloads are a packet number, 300 zero bytes
+# and then 20 bytes of 0xFF
+write_padded_pcap() {
+  padding=''
+  j=0
+  while [ "$j" -lt 320 ]; do
+    if [ "$j" -lt 300 ]; then
+      padding="$padding\\000"
+    else
+      padding="$padding\\377"
+    fi
+    j=$((j + 1))
+  done
+  {
+    printf '\324\303\262\241\002\000\004\000\000\000\000\000\000\000\000\000'\
+'\377\377\000\000\001\000\000\000'
+    i=0
+    while [ "$i" -lt "$2" ]; do
+      record=''
+      append_le32 $((1000 + i / 100))
+      append_le32 $((i % 100 * 10000))
+      append_le32 324
+      append_le32 324
+      append_le32 "$i"
+      printf "$record$padding"
+      i=$((i + 1))
+    done
+  } > "$1"
+}
+
+# write_nano_pcap <file>: a nanosecond PCAP with 10 packets of 12 bytes,
+# at 100 to 109 ns after 1700000000
+write_nano_pcap() {
+  {
+    printf '\115\074\262\241\002\000\004\000\000\000\000\000\000\000\000\000'\
+'\377\377\000\000\001\000\000\000'
+    i=0
+    while [ "$i" -lt 10 ]; do
+      record=''
+      append_le32 1700000000
+      append_le32 $((100 + i))
+      append_le32 12
+      append_le32 12
+      append_le32 "$i"
+      append_le32 "$i"
+      append_le32 "$i"
+      printf "$record"
+      i=$((i + 1))
+    done
+  } > "$1"
+}
+
+# append_int <bytes> <value>: appends a 2 or 4 byte value to record as
+# printf escapes, in the byte order in $byte_order (le or be)
+append_int() {
+  if [ "$1" -eq 2 ]; then shifts='0 8'; else shifts='0 8 16 24'; fi
+  if [ "$byte_order" = be ]; then
+    if [ "$1" -eq 2 ]; then shifts='8 0'; else shifts='24 16 8 0'; fi
+  fi
+  for shift in $shifts; do
+    byte=$((($2 >> shift) & 255))
+    record="$record\\$((byte / 64))$((byte / 8 % 8))$((byte % 8))"
+  done
+}
+
+# write_timed_pcap <file> <byte order> <count> <step> <offset> <skew>: a
+# microsecond PCAP in the given byte order (le or be) with count packets
+# of 12 bytes, each starting with its packet number. Packet i is at offset
+# + i * step microseconds, stretched by skew parts per million.
+write_timed_pcap() {
+  byte_order=$2
+  record=''
+  append_int 4 2712847316
+  append_int 2 2
+  append_int 2 4
+  append_int 4 0
+  append_int 4 0
+  append_int 4 65535
+  append_int 4 1
+  {
+    printf "$record"
+    i=0
+    while [ "$i" -lt "$3" ]; do
+      time=$(($5 + $4 * i + $4 * i * $6 / 1000000))
+      record=''
+      append_int 4 $((time / 1000000))
+      append_int 4 $((time % 1000000))
+      append_int 4 12
+      append_int 4 12
+      byte_order=le
+      append_int 4 "$i"
+      byte_order=$2
+      printf "$record\\252\\252\\252\\252\\252\\252\\252\\252"
+      i=$((i + 1))
+    done
+  } > "$1"
+}
+
+# write_pcapng <file> <link type> <byte order>: a pcapng holding the same
+# 20 packets as write_pcap <file> 20 12, on the first of two interfaces.
+# The first interface is Ethernet, the second has the given link type.
+write_pcapng() {
+  byte_order=$3
+  record=''
+  # Section header, with an unknown section length
+  append_int 4 168627466
+  append_int 4 28
+  append_int 4 439041101
+  append_int 2 1
+  append_int 2 0
+  record="$record\\377\\377\\377\\377\\377\\377\\377\\377"
+  append_int 4 28
+  for link_type in 1 "$2"; do
+    append_int 4 1
+    append_int 4 20
+    append_int 2 "$link_type"
+    append_int 2 0
+    append_int 4 65535
+    append_int 4 20
+  done
+  printf "$record" > "$1"
+  i=0
+  while [ "$i" -lt 20 ]; do
+    # Enhanced packets, with the default microsecond timestamps
+    record=''
+    append_int 4 6
+    append_int 4 44
+    append_int 4 0
+    append_int 4 0
+    append_int 4 $((i * 1000000))
+    append_int 4 12
+    append_int 4 12
+    byte=$(printf '\\%03o' "$i")
+    record="$record$byte$byte$byte$byte$byte$byte$byte$byte$byte$byte$byte$byte"
+    append_int 4 44
+    printf "$record" >> "$1"
+    i=$((i + 1))
+  done
+}
+
+# write_udp_pcap <file> <parity>: an Ethernet PCAP with 10 UDP packets of
+# 50 bytes, one per second, whose payloads start with their packet number.
+# Packet i is sent from port 1000 + (i + parity) % 2, so the two flows of a
+# file swap packets with the other parity.
+write_udp_pcap() {
+  byte_order=le
+  record=''
+  append_int 4 2712847316
+  append_int 2 2
+  append_int 2 4
+  append_int 4 0
+  append_int 4 0
+  append_int 4 65535
+  append_int 4 1
+  printf "$record" > "$1"
+  i=0
+  while [ "$i" -lt 10 ]; do
+    byte_order=le
+    record=''
+    append_int 4 "$i"
+    append_int 4 0
+    append_int 4 50
+    append_int 4 50
+    # Ethernet, IPv4 from 10.0.0.1 to 10.0.0.2, UDP to port 2000
+    byte_order=be
+    append_int 4 0
+    append_int 4 0
+    append_int 4 0
+    append_int 2 2048
+    append_int 4 1157627940
+    append_int 4 0
+    append_int 4 1074855936
+    append_int 4 167772161
+    append_int 4 167772162
+    append_int 2 $((1000 + (i + $2) % 2))
+    append_int 2 2000
+    append_int 2 16
+    append_int 2 0
+    append_int 4 "$i"
+    append_int 4 0
+    printf "$record" >> "$1"
+    i=$((i + 1))
+  done
+}
+
+# expect_matched <name> <count> <pcap_diff arguments...>
+expect_matched() {
+  name=$1
+  count=$2
+  shift 2
+  output=$("$PCAP_DIFF" -v "$@" 2>&1)
+  status=$?
+  # pcap_diff exits with 1 when the files differ, higher codes are errors
+  if [ "$status" -gt 1 ]; then
+    echo "FAIL: $name (exit code $status)"
+    FAILED=1
+  elif ! echo "$output" | grep -Eq "^Matched: +$count "; then
+    echo "FAIL: $name (expected $count matched packets)"
+    echo "$output"
+    FAILED=1
+  else
+    echo "PASS: $name"
+  fi
+}
+
+write_pcap "$WORK_DIR/a.pcap" 20 12
+write_pcap "$WORK_DIR/b.pcap" 20 12
+
+for method in timestamp full location sequence; do
+  expect_matched "identical files, $method search" 20 -s "$method" \
+    "$WORK_DIR/a.pcap" "$WORK_DIR/b.pcap"
+  # Both ranges select no bytes, so every packet compares equal
+  expect_matched "empty range, $method search" 20 -s "$method" \
+    -a '[6:-6]' -b '[6:-6]' "$WORK_DIR/a.pcap" "$WORK_DIR/b.pcap"
+  expect_matched "inverted range, $method search" 20 -s "$method" \
+    -a '[10:-5]' -b '[10:-5]' "$WORK_DIR/a.pcap" "$WORK_DIR/b.pcap"
+done
+expect_matched "inverted range, streamed" 20 -S \
+  -a '[10:-5]' -b '[10:-5]' "$WORK_DIR/a.pcap" "$WORK_DIR/b.pcap"
+
+# Packet index (--index). The sidecar header is 48 bytes, followed by the
+# timestamp column and then the offset column.
+cp "$WORK_DIR/a.pcap" "$WORK_DIR/ia.pcap"
+cp "$WORK_DIR/b.pcap" "$WORK_DIR/ib.pcap"
+expect_matched "index written" 20 -I "$WORK_DIR/ia.pcap" "$WORK_DIR/ib.pcap"
+expect_matched "index read" 20 -I "$WORK_DIR/ia.pcap" "$WORK_DIR/ib.pcap"
+printf '\377\377\377\377\377\377\377\177' | dd of="$WORK_DIR/ia.pcap.pdidx" \
+  bs=1 seek=$((48 + 20 * 8)) conv=notrunc 2>/dev/null
+expect_matched "corrupt index offset" 20 -I \
+  "$WORK_DIR/ia.pcap" "$WORK_DIR/ib.pcap"
+expect_matched "corrupt index rewritten" 20 -I \
+  "$WORK_DIR/ia.pcap" "$WORK_DIR/ib.pcap"
+
+# Time windows are found by bisecting on the byte offset, which must not
+# mistake runs of zero bytes in packet data for packet headers. With 6001
+# packets the first midpoint falls inside the zero padding of a packet.
+write_padded_pcap "$WORK_DIR/padded.pcap" 6001
+for start in 1000 1012 1030 1047 1054; do
+  expect_matched "time window from $start on zero padded packets" 501 \
+    --start-time=$start --end-time=$((start + 5)) \
+    "$WORK_DIR/padded.pcap" "$WORK_DIR/padded.pcap"
+done
+expect_matched "time window on zero padded packets from a pipe" 501 \
+  --start-time=1030 --end-time=1035 - "$WORK_DIR/padded.pcap" \
+  < "$WORK_DIR/padded.pcap"
+expect_matched "streamed time window on zero padded packets" 501 -S \
+  --start-time=1030 --end-time=1035 "$WORK_DIR/padded.pcap" \
+  "$WORK_DIR/padded.pcap"
+
+# Times given as seconds since the epoch keep nanosecond precision
+write_nano_pcap "$WORK_DIR/nano.pcap"
+expect_matched "nanosecond start time" 5 \
+  --start-time=1700000000.000000105 "$WORK_DIR/nano.pcap" "$WORK_DIR/nano.pcap"
+expect_matched "nanosecond end time" 3 \
+  --end-time=1700000000.000000102 "$WORK_DIR/nano.pcap" "$WORK_DIR/nano.pcap"
+
+# expect_error <name> <message> <pcap_diff arguments...>
+expect_error() {
+  name=$1
+  message=$2
+  shift 2
+  output=$("$PCAP_DIFF" "$@" 2>&1)
+  status=$?
+  if [ "$status" -ne 2 ] || ! echo "$output" | grep -q "$message"; then
+    echo "FAIL: $name (expected an error containing \"$message\")"
+    echo "$output"
+    FAILED=1
+  else
+    echo "PASS: $name"
+  fi
+}
+
+# pcapng input is read the same as the classic PCAP it was written from
+write_pcapng "$WORK_DIR/a.pcapng" 1 le
+expect_matched "pcapng against pcap" 20 "$WORK_DIR/a.pcapng" "$WORK_DIR/b.pcap"
+expect_matched "pcapng against pcap, streamed" 20 -S \
+  "$WORK_DIR/a.pcapng" "$WORK_DIR/b.pcap"
+expect_matched "pcapng time window" 6 --start-time=5 --end-time=10 \
+  "$WORK_DIR/a.pcapng" "$WORK_DIR/b.pcap"
+write_pcapng "$WORK_DIR/mixed.pcapng" 101 le
+expect_error "pcapng with mixed link layers" "different link layers" \
+  "$WORK_DIR/mixed.pcapng" "$WORK_DIR/b.pcap"
+write_pcapng "$WORK_DIR/be.pcapng" 1 be
+expect_error "big endian pcapng" "different endian" \
+  "$WORK_DIR/be.pcapng" "$WORK_DIR/b.pcap"
+expect_error "big endian pcapng, streamed" "different endian" -S \
+  - "$WORK_DIR/b.pcap" < "$WORK_DIR/be.pcapng"
+
+# Byte-swapped PCAPs are read the same as native ones
+write_timed_pcap "$WORK_DIR/timed.pcap" le 1000 10000 0 0
+write_timed_pcap "$WORK_DIR/timed_be.pcap" be 1000 10000 0 0
+expect_matched "opposite endian pcap" 1000 \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/timed_be.pcap"
+expect_matched "opposite endian pcap, streamed" 1000 -S \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/timed_be.pcap"
+expect_matched "opposite endian pcap, time window" 101 \
+  --start-time=2 --end-time=3 "$WORK_DIR/timed_be.pcap" "$WORK_DIR/timed.pcap"
+
+# Compressed captures, for each compressor installed here. A format this
+# build has no support for is skipped.
+for compressor in gzip zstd lz4; do
+  if ! command -v "$compressor" > /dev/null 2>&1; then
+    echo "SKIP: $compressor input ($compressor is not installed)"
+    continue
+  fi
+  "$compressor" -c "$WORK_DIR/timed.pcap" > "$WORK_DIR/timed.pcap.z"
+  if "$PCAP_DIFF" "$WORK_DIR/timed.pcap.z" "$WORK_DIR/timed.pcap" 2>&1 | \
+      grep -q "built without"; then
+    echo "SKIP: $compressor input (not supported by this build)"
+    continue
+  fi
+  expect_matched "$compressor input" 1000 \
+    "$WORK_DIR/timed.pcap.z" "$WORK_DIR/timed.pcap"
+  expect_matched "$compressor input, streamed" 1000 -S \
+    "$WORK_DIR/timed.pcap.z" "$WORK_DIR/timed.pcap"
+  expect_matched "$compressor input from stdin" 1000 \
+    - "$WORK_DIR/timed.pcap" < "$WORK_DIR/timed.pcap.z"
+  expect_matched "$compressor input from stdin, streamed" 1000 -S \
+    - "$WORK_DIR/timed.pcap" < "$WORK_DIR/timed.pcap.z"
+done
+head -c 2000 "$WORK_DIR/timed.pcap.z" > "$WORK_DIR/truncated.pcap.z"
+expect_error "truncated compressed input" "truncated" \
+  "$WORK_DIR/truncated.pcap.z" "$WORK_DIR/timed.pcap"
+
+# Automatic time alignment, with file B 100 seconds behind file A
+write_timed_pcap "$WORK_DIR/shifted.pcap" le 1000 10000 100000000 0
+expect_matched "shifted file" 0 \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/shifted.pcap"
+expect_matched "shifted file, auto time align" 1000 -A \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/shifted.pcap"
+expect_matched "shifted file, auto time align, swapped" 1000 -A \
+  "$WORK_DIR/shifted.pcap" "$WORK_DIR/timed.pcap"
+expect_error "auto time align, streamed" "mutually exclusive" -A -S \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/shifted.pcap"
+
+# Drift tracking, with file B's clock running 500 ppm fast. A 1 ms window
+# only holds the first 2 seconds of packets without it.
+write_timed_pcap "$WORK_DIR/drift.pcap" le 1000 10000 0 500
+expect_matched "drifting clock" 201 -d 0.001 -D 0.001 \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/drift.pcap"
+expect_matched "drifting clock, tracked" 1000 --track-drift -d 0.001 -D 0.001 \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/drift.pcap"
+expect_matched "drifting clock, tracked, streamed" 1000 --track-drift -S \
+  -d 0.001 -D 0.001 "$WORK_DIR/timed.pcap" "$WORK_DIR/drift.pcap"
+expect_error "drift tracking, full search" "timestamp" --track-drift -s full \
+  "$WORK_DIR/timed.pcap" "$WORK_DIR/drift.pcap"
+
+# Flow matching, on the UDP payloads only
+write_udp_pcap "$WORK_DIR/flows.pcap" 0
+write_udp_pcap "$WORK_DIR/flows_swapped.pcap" 1
+for method in timestamp full sequence; do
+  expect_matched "$method search by flow" 10 --by-flow -s "$method" \
+    "$WORK_DIR/flows.pcap" "$WORK_DIR/flows.pcap"
+  expect_matched "$method search of swapped flows" 10 -s "$method" \
+    -a '[42:]' -b '[42:]' "$WORK_DIR/flows.pcap" "$WORK_DIR/flows_swapped.pcap"
+  expect_matched "$method search by flow of swapped flows" 0 --by-flow \
+    -s "$method" -a '[42:]' -b '[42:]' \
+    "$WORK_DIR/flows.pcap" "$WORK_DIR/flows_swapped.pcap"
+done
+expect_error "by flow, streamed" "can't be used with" --by-flow -S \
+  "$WORK_DIR/flows.pcap" "$WORK_DIR/flows.pcap"
+
+mkfifo "$WORK_DIR/a.fifo"
+cat "$WORK_DIR/a.pcap" > "$WORK_DIR/a.fifo" &
+expect_matched "named pipe, streamed" 20 -S \
+  "$WORK_DIR/a.fifo" "$WORK_DIR/b.pcap"
+wait
+
+exit $FAILED